@@ -1,11 +1,19 @@
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <sys/wait.h>
 
 #include "bang.h"
+#include "crc.h"
 #include "err.h"
+#include "stats.h"
 
 enum pipe_err { PIPE_OK, PIPE_ERR };
 
@@ -13,11 +21,49 @@ enum write_err { WRITE_OK, WRITE_ERR };
 
 #define NULL_OUTPUT ((struct bang_output) { .buf = NULL, .sz = 0 })
 
+/* How much is written to the command at a time. */
+#define WRITESZ 65536
+
+/* What bangmemo keeps between them: at most MEMOS runs, and MEMOSZ bytes
+ * of commands, inputs and outputs. */
+#define MEMOS 16
+#define MEMOSZ (64 << 20)
+
+/* Output being read from a pipe, and the room there is for it. */
+struct collect {
+	int fd;
+	int allocsz;
+	struct bang_output o;
+};
+
+/* A run of a command that succeeded.  The input is kept to tell a match
+ * from another input with the same checksum. */
+struct memo {
+	char *cmd;
+	char *in;
+	int insz;
+	uint32_t crc;
+	struct bang_output out;
+};
+
+/* Most recently used first. */
+static struct memo memos[MEMOS];
+static int nmemos;
+
+extern char **environ;
+
 static enum pipe_err openpipes(int in[2], int out[2], int err[2]);
 static void closepipes(int in[2], int out[2], int err[2]);
-static void child_exec(int in[2], int out[2], int err[2], char *cmd);
-static enum write_err write_input(int in, char *data, int sz);
-static struct bang_output collect_output(int out);
+static int child_spawn(pid_t *pid, int in[2], int out[2], int err[2],
+                       char *cmd);
+static int collect_some(struct collect *c);
+static enum write_err transfer(int *in, char *data, int sz,
+                               struct collect *out, struct collect *err);
+static size_t memosz(char *cmd, int insz, int outsz);
+static void memodrop(int i);
+static int memofind(char *cmd, char *in, int sz, uint32_t crc);
+static void memoadd(char *cmd, char *in, int sz, uint32_t crc,
+                    struct bang_output *out);
 
 static enum pipe_err openpipes(int in[2], int out[2], int err[2])
 {
@@ -48,59 +94,124 @@ static void closepipes(int in[2], int out[2], int err[2])
 	}
 }
 
-static void child_exec(int in[2], int out[2], int err[2], char *cmd)
+/*
+ * Starts the shell on the child's ends of the pipes.  posix_spawn doesn't
+ * copy the editor's page tables as fork does (glibc's shares the memory
+ * until the exec, like vfork), so this takes as long with a 4 GB buffer
+ * open as with an empty one, and can't fail for want of memory to
+ * overcommit.
+ */
+static int child_spawn(pid_t *pid, int in[2], int out[2], int err[2],
+                       char *cmd)
 {
-	close(in[1]);
-	close(out[0]);
-	close(err[0]);
-	dup2(in[0], STDIN_FILENO);
-	dup2(out[1], STDOUT_FILENO);
-	dup2(err[1], STDERR_FILENO);
-	execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	sigset_t def;
+	char *argv[] = { "/bin/sh", "-c", cmd, NULL };
+	int r;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_addclose(&fa, in[1]);
+	posix_spawn_file_actions_addclose(&fa, out[0]);
+	posix_spawn_file_actions_addclose(&fa, err[0]);
+	posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+	posix_spawn_file_actions_addclose(&fa, in[0]);
+	posix_spawn_file_actions_addclose(&fa, out[1]);
+	posix_spawn_file_actions_addclose(&fa, err[1]);
+	/* The editor ignores SIGPIPE while it writes; the command shouldn't. */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&def);
+	sigaddset(&def, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &def);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+	r = posix_spawn(pid, "/bin/sh", &fa, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	return r == 0 ? 0 : -1;
 }
 
-static enum write_err write_input(int in, char *data, int sz)
+/* Reads what's there, keeping a byte spare to end the text with a nul.
+ * Returns 1 for more to come, 0 at the end of the output and -1 on
+ * failure. */
+static int collect_some(struct collect *c)
 {
-	ssize_t total_written = 0;
-	while (total_written < sz) {
-		char *write_ptr = data + total_written;
-		int left = sz - total_written;
-		ssize_t written = write(in, write_ptr, left);
-		if (written == -1)
-			return WRITE_ERR;
-		total_written += written;
+	if (c->allocsz - c->o.sz <= 1) {
+		char *reallocated = realloc(c->o.buf, c->allocsz * 2);
+		if (reallocated == NULL)
+			return -1;
+		c->o.buf = reallocated;
+		c->allocsz *= 2;
 	}
-	close(in);
-	return WRITE_OK;
+	ssize_t r = read(c->fd, c->o.buf + c->o.sz, c->allocsz - c->o.sz - 1);
+	if (r == -1)
+		return errno == EINTR || errno == EAGAIN ? 1 : -1;
+	c->o.sz += r;
+	c->o.buf[c->o.sz] = '\0';
+	return r > 0;
 }
 
-static struct bang_output collect_output(int fd)
+/*
+ * Writes the input while reading the output and errors, so that neither
+ * the editor nor the command can fill a pipe and wait for the other.  A
+ * command that exits without reading all its input isn't an error.
+ */
+static enum write_err transfer(int *in, char *data, int sz,
+                               struct collect *out, struct collect *err)
 {
-	char *allocated = malloc(8192);
-	if (allocated == NULL) {
-		close(fd);
-		return NULL_OUTPUT;
+	struct collect *c[2] = { out, err }, *o;
+	struct pollfd p[3];
+	int written = 0, left, n, i, r;
+	ssize_t w;
+	fcntl(*in, F_SETFL, fcntl(*in, F_GETFL) | O_NONBLOCK);
+	if (sz == 0) {
+		close(*in);
+		*in = -1;
 	}
-	int allocsz = 8192;
-	int datasz = 0;
-	while (1) {
-		ssize_t r = read(fd, allocated + datasz, allocsz - datasz);
-		if (r == 0)
-			break;
-		datasz += r;
-		if (allocsz - datasz == 0) {
-			char *reallocated = realloc(allocated, allocsz * 2);
-			if (reallocated == NULL) {
-				free(allocated);
-				close(fd);
-				return NULL_OUTPUT;
+	while (*in != -1 || out->fd != -1 || err->fd != -1) {
+		n = 0;
+		if (*in != -1)
+			p[n++] = (struct pollfd) {
+				.fd = *in, .events = POLLOUT
+			};
+		for (i = 0; i < 2; i++)
+			if (c[i]->fd != -1)
+				p[n++] = (struct pollfd) {
+					.fd = c[i]->fd, .events = POLLIN
+				};
+		if (poll(p, n, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return WRITE_ERR;
+		}
+		for (i = 0; i < n; i++) {
+			if (!p[i].revents)
+				continue;
+			if (p[i].fd != *in) {
+				o = p[i].fd == out->fd ? out : err;
+				if ((r = collect_some(o)) < 0)
+					return WRITE_ERR;
+				if (r == 0) {
+					close(o->fd);
+					o->fd = -1;
+				}
+				continue;
+			}
+			left = sz - written;
+			w = write(*in, data + written,
+			          left < WRITESZ ? left : WRITESZ);
+			if (w == -1 && errno != EAGAIN && errno != EINTR &&
+			    errno != EPIPE)
+				return WRITE_ERR;
+			if (w > 0)
+				written += w;
+			if ((w == -1 && errno == EPIPE) || written == sz) {
+				close(*in);
+				*in = -1;
 			}
-			allocated = reallocated;
-			allocsz *= 2;
 		}
 	}
-	close(fd);
-	return (struct bang_output) { .buf = allocated, .sz = datasz };
+	return WRITE_OK;
 }
 
 int bang(
@@ -117,30 +228,145 @@ int bang(
 		return -1;
 	}
 
-	int child = fork();
-	if (child == -1) {
-		seterr("fork");
+	pid_t child;
+	if (child_spawn(&child, inpipe, outpipe, errpipe, cmd) < 0) {
+		seterr("posix_spawn");
 		closepipes(inpipe, outpipe, errpipe);
 		*out = NULL_OUTPUT;
 		*err = NULL_OUTPUT;
 		return -1;
 	}
 
-	if (child == 0) {
-		child_exec(inpipe, outpipe, errpipe, cmd);
-	} else {
-		close(inpipe[0]);
-		close(outpipe[1]);
-		close(errpipe[1]);
-		write_input(inpipe[1], input, input_sz);
-		*out = collect_output(outpipe[0]);
-		*err = collect_output(errpipe[0]);
-		int status;
-		if (wait(&status) < 0)
-			return -1;
-		if (WEXITSTATUS(status) != EXIT_SUCCESS)
+	close(inpipe[0]);
+	close(outpipe[1]);
+	close(errpipe[1]);
+	struct collect o = { .fd = outpipe[0], .allocsz = 8192 };
+	struct collect e = { .fd = errpipe[0], .allocsz = 8192 };
+	o.o.buf = calloc(1, o.allocsz);
+	e.o.buf = calloc(1, e.allocsz);
+	void (*oldpipe)(int) = signal(SIGPIPE, SIG_IGN);
+	enum write_err w = WRITE_ERR;
+	if (o.o.buf && e.o.buf)
+		w = transfer(&inpipe[1], input, input_sz, &o, &e);
+	signal(SIGPIPE, oldpipe);
+	if (w != WRITE_OK) {
+		/* Stop the command rather than wait on it. */
+		kill(child, SIGTERM);
+		if (inpipe[1] != -1)
+			close(inpipe[1]);
+	}
+	if (o.fd != -1)
+		close(o.fd);
+	if (e.fd != -1)
+		close(e.fd);
+	stats.bangin += input_sz;
+	stats.bangout += o.o.sz;
+	*out = o.o;
+	*err = e.o;
+
+	int status;
+	while (waitpid(child, &status, 0) == -1)
+		if (errno != EINTR)
 			return -1;
+	if (w != WRITE_OK) {
+		seterr("bang");
+		return -1;
 	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		return -1;
+
+	return 0;
+}
 
+static size_t memosz(char *cmd, int insz, int outsz)
+{
+	return strlen(cmd) + 1 + insz + outsz + 1;
+}
+
+static void memodrop(int i)
+{
+	struct memo *m = &memos[i];
+	memsub(&stats.memobytes, memosz(m->cmd, m->insz, m->out.sz));
+	free(m->cmd);
+	free(m->in);
+	free(m->out.buf);
+	memmove(m, m + 1, (--nmemos - i) * sizeof(*m));
+}
+
+/* Finds the run of cmd on the input and moves it to the front.  Returns
+ * its index (so 0), or -1 if there isn't one. */
+static int memofind(char *cmd, char *in, int sz, uint32_t crc)
+{
+	struct memo m;
+	int i;
+	for (i = 0; i < nmemos; i++)
+		if (memos[i].crc == crc && memos[i].insz == sz &&
+		    !strcmp(memos[i].cmd, cmd) && !memcmp(memos[i].in, in, sz))
+			break;
+	if (i == nmemos)
+		return -1;
+	m = memos[i];
+	memmove(memos + 1, memos, i * sizeof(m));
+	memos[0] = m;
+	return 0;
+}
+
+/* Keeps a copy of the run, dropping the least recently used to make room.
+ * Not keeping it for want of memory isn't an error. */
+static void memoadd(char *cmd, char *in, int sz, uint32_t crc,
+                    struct bang_output *out)
+{
+	struct memo m = { .insz = sz, .crc = crc };
+	size_t need = memosz(cmd, sz, out->sz);
+	if (need > MEMOSZ)
+		return;
+	while (nmemos && (nmemos == MEMOS ||
+	                  stats.memobytes.now + need > MEMOSZ))
+		memodrop(nmemos - 1);
+	m.cmd = strdup(cmd);
+	m.in = malloc(sz ? sz : 1);
+	m.out.buf = malloc(out->sz + 1);
+	if (!m.cmd || !m.in || !m.out.buf) {
+		free(m.cmd);
+		free(m.in);
+		free(m.out.buf);
+		return;
+	}
+	memcpy(m.in, in, sz);
+	memcpy(m.out.buf, out->buf, out->sz + 1);
+	m.out.sz = out->sz;
+	memmove(memos + 1, memos, nmemos++ * sizeof(m));
+	memos[0] = m;
+	memadd(&stats.memobytes, need);
+}
+
+int bangmemo(
+	struct bang_output *out, struct bang_output *err,
+	char *cmd, char *input, int input_sz)
+{
+	uint32_t crc = 0;
+	int keep = memosz(cmd, input_sz, 0) <= MEMOSZ;
+	if (keep) {
+		crc = crc32c(0, input, input_sz);
+		if (memofind(cmd, input, input_sz, crc) == 0) {
+			out->buf = malloc(memos[0].out.sz + 1);
+			err->buf = calloc(1, 1);
+			if (out->buf && err->buf) {
+				memcpy(out->buf, memos[0].out.buf,
+				       memos[0].out.sz + 1);
+				out->sz = memos[0].out.sz;
+				err->sz = 0;
+				stats.memohits++;
+				return 0;
+			}
+			free(out->buf);
+			free(err->buf);
+		}
+	}
+	stats.memomisses++;
+	if (bang(out, err, cmd, input, input_sz) < 0)
+		return -1;
+	if (keep)
+		memoadd(cmd, input, input_sz, crc, out);
 	return 0;
 }
@@ -8,3 +8,12 @@ struct bang_output {
 int bang(
 	struct bang_output *out, struct bang_output *err,
 	char *cmd, char *input, int input_sz);
+
+/*
+ * bang, remembering what each command output for its input: run again on
+ * the same input, a command isn't run, and gives what it gave before.
+ * Only runs that succeed are kept, the most recent 16 or 64 MB of them.
+ */
+int bangmemo(
+	struct bang_output *out, struct bang_output *err,
+	char *cmd, char *input, int input_sz);
@@ -0,0 +1,228 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Benchmarks lwe's commands on generated files.  lwe is linked against
+ * the headless curses in bench/curses.c, and each scenario feeds a key
+ * script through the real command table in a forked copy of the editor,
+ * so every run starts from a freshly opened file.
+ *
+ *	usage: bench [sizes in MB...]
+ *
+ * The default sizes are 1, 16, 256 and 1024 MB; BENCH_SIZES can also
+ * hold a list.  Times are in milliseconds.  "open" is the time to read
+ * the file and draw the first frame.  Every other column is the time
+ * from the first key to the final quit, or where a scenario has to set
+ * something up first (undo an insert, put a yank), from the mark after
+ * the setup.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "curses.h"
+
+#define NEEDLE "needle-zz"
+/* Where the timed part of a key script starts. */
+#define MARK "\001"
+#define MAXSIZES 16
+#define KEYSZ 4096
+
+struct scenario {
+	char *name;
+	char keys[KEYSZ];
+};
+
+struct result {
+	double open;
+	double run;
+};
+
+int lwe_main(int argc, char **argv);
+
+static char dir[] = "/tmp/lwe_bench_XXXXXX";
+static struct scenario sc[16];
+static int nsc;
+
+static double now(void);
+static void addscenario(char *name, ...);
+static void mkscenarios(void);
+static void genfile(char *path, size_t sz);
+static struct result run(char *path, struct scenario *s);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Adds a scenario whose key script is the concatenation of the given
+ * strings (NULL terminated).  A string of the form "<n>*c" repeats c. */
+static void addscenario(char *name, ...)
+{
+	struct scenario *s = &sc[nsc++];
+	va_list ap;
+	char *part;
+	s->name = name;
+	s->keys[0] = '\0';
+	va_start(ap, name);
+	while ((part = va_arg(ap, char *))) {
+		char *star = strchr(part, '*');
+		size_t len = strlen(s->keys);
+		if (star && star != part && star[1] != '\0') {
+			int n = atoi(part);
+			for (int i = 0; i < n && len < KEYSZ - 1; i++)
+				s->keys[len++] = star[1];
+			s->keys[len] = '\0';
+		} else {
+			strncat(s->keys, part, KEYSZ - len - 1);
+		}
+	}
+	va_end(ap);
+}
+
+/* With the default 50 line screen, picking the first line takes two
+ * layers of line labels ("aa"), and a line range takes two picks. */
+static void mkscenarios(void)
+{
+	char *text = "the quick brown fox jumps over the lazy dog, twice. ";
+	addscenario("open", "q", NULL);
+	addscenario("scroll", "200*j", "100*k", "q", NULL);
+	addscenario("search", "/", NEEDLE, "\r", "q", NULL);
+	addscenario("insert", "Iaa", text, "\033", "q", NULL);
+	addscenario("undo", "Iaa", text, "\033", MARK, "u", "q", NULL);
+	addscenario("yank", "Yaaaa", "q", NULL);
+	addscenario("put", "Yaaaa", MARK, "Paaa", "q", NULL);
+	addscenario("bang", "!aaaa", "tr a-z A-Z\r", "q", NULL);
+	addscenario("replace", "%dolor\rDOLOR\r", " ", "q", NULL);
+	addscenario("write", "w", "q", NULL);
+}
+
+/* Writes sz bytes of text: lines of pseudo-random words, with the
+ * search needle on the last line. */
+static void genfile(char *path, size_t sz)
+{
+	static const char *words[] = {
+		"lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+		"adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+		"\tincididunt", "ut", "labore", "et", "dolore", "magna",
+	};
+	unsigned long x = 88172645463325252UL;
+	size_t n = 0, col = 0;
+	FILE *f;
+	if (!(f = fopen(path, "w"))) {
+		perror(path);
+		exit(1);
+	}
+	while (n + sizeof(NEEDLE) + 1 < sz) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		const char *w = words[x % (sizeof(words) / sizeof(words[0]))];
+		size_t wl = strlen(w);
+		if (n + wl + sizeof(NEEDLE) + 2 >= sz)
+			break;
+		fputs(w, f);
+		col += wl;
+		n += wl;
+		if (col > 40 + (x >> 8) % 60) {
+			fputc('\n', f);
+			col = 0;
+		} else {
+			fputc(' ', f);
+			col++;
+		}
+		n++;
+	}
+	fputs("\n" NEEDLE "\n", f);
+	fclose(f);
+}
+
+/* Runs one scenario in a child process and collects its timings. */
+static struct result run(char *path, struct scenario *s)
+{
+	struct result r = { -1, -1 };
+	int fds[2], st;
+	pid_t pid;
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		char *argv[] = { "lwe", path, NULL };
+		close(fds[0]);
+		bench_keys(s->keys);
+		double start = now();
+		lwe_main(2, argv);
+		r.open = bench_first - start;
+		r.run = bench_last - (bench_mark ? bench_mark : bench_first);
+		if (write(fds[1], &r, sizeof(r)) != sizeof(r))
+			_exit(1);
+		_exit(0);
+	}
+	close(fds[1]);
+	if (read(fds[0], &r, sizeof(r)) != sizeof(r))
+		r.open = r.run = -1;
+	close(fds[0]);
+	waitpid(pid, &st, 0);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	size_t sizes[MAXSIZES] = { 1, 16, 256, 1024 };
+	int nsizes = 4;
+	char path[128], cmd[128], *env, *tok;
+	if (argc > 1) {
+		for (nsizes = 0; nsizes + 1 < argc && nsizes < MAXSIZES; nsizes++)
+			sizes[nsizes] = strtoul(argv[nsizes + 1], NULL, 10);
+	} else if ((env = getenv("BENCH_SIZES"))) {
+		nsizes = 0;
+		for (tok = strtok(env, " ,"); tok && nsizes < MAXSIZES;
+		     tok = strtok(NULL, " ,"))
+			sizes[nsizes++] = strtoul(tok, NULL, 10);
+	}
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	/* Keep the yank file of put / bang runs out of the user's way. */
+	setenv("TMPDIR", dir, 1);
+	mkscenarios();
+
+	printf("%8s", "MB");
+	for (int i = 0; i < nsc; i++)
+		printf(" %9s", sc[i].name);
+	printf("\n");
+	for (int i = 0; i < nsizes; i++) {
+		struct result res[16];
+		snprintf(path, sizeof(path), "%s/text", dir);
+		genfile(path, sizes[i] << 20);
+		for (int j = 0; j < nsc; j++)
+			res[j] = run(path, &sc[j]);
+		printf("%8zu", sizes[i]);
+		for (int j = 0; j < nsc; j++) {
+			double t = j == 0 ? res[j].open : res[j].run;
+			if (res[j].run < 0)
+				printf(" %9s", "failed");
+			else
+				printf(" %9.2f", t * 1e3);
+		}
+		printf("\n");
+		fflush(stdout);
+		unlink(path);
+	}
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "could not remove %s\n", dir);
+	return 0;
+}
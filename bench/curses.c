@@ -0,0 +1,193 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "curses.h"
+
+#define MAXLINES 512
+#define MAXCOLS 1024
+
+static WINDOW win;
+WINDOW *stdscr = &win;
+int LINES = 50, COLS = 160, TABSIZE = 8, ESCDELAY;
+
+static int screen[MAXLINES][MAXCOLS];
+static int attr;
+static const char *keys;
+static int overrun;
+double bench_first, bench_last, bench_mark;
+
+WINDOW *initscr(void)
+{
+	char *e;
+	if ((e = getenv("LINES")) && atoi(e) > 1 && atoi(e) <= MAXLINES)
+		LINES = atoi(e);
+	if ((e = getenv("COLUMNS")) && atoi(e) > 1 && atoi(e) <= MAXCOLS)
+		COLS = atoi(e);
+	return stdscr;
+}
+
+SCREEN *newterm(const char *type, FILE *out, FILE *in)
+{
+	(void)type; (void)out; (void)in;
+	initscr();
+	return (SCREEN *)stdscr;
+}
+
+int endwin(void) { return OK; }
+int cbreak(void) { return OK; }
+int noecho(void) { return OK; }
+int nonl(void) { return OK; }
+int intrflush(WINDOW *w, int b) { (void)w; (void)b; return OK; }
+int keypad(WINDOW *w, int b) { (void)w; (void)b; return OK; }
+int define_key(const char *def, int key) { (void)def; (void)key; return OK; }
+int start_color(void) { return OK; }
+
+int init_pair(short pair, short fg, short bg)
+{
+	(void)pair; (void)fg; (void)bg;
+	return OK;
+}
+
+int erase(void)
+{
+	for (int i = 0; i < LINES; i++)
+		memset(screen[i], 0, COLS * sizeof(screen[0][0]));
+	win.cury = win.curx = 0;
+	return OK;
+}
+
+int refresh(void)
+{
+	return OK;
+}
+
+int move(int y, int x)
+{
+	if (y < 0 || y >= LINES || x < 0 || x >= COLS)
+		return ERR;
+	win.cury = y;
+	win.curx = x;
+	return OK;
+}
+
+/* Behaves like waddch without scrollok: wraps at the right margin,
+ * clears to the end of the line on newline, expands tabs, and fails
+ * once the bottom right corner has been written. */
+int addch(int c)
+{
+	if (win.cury >= LINES)
+		return ERR;
+	if (c == '\n') {
+		for (int x = win.curx; x < COLS; x++)
+			screen[win.cury][x] = 0;
+		win.curx = 0;
+		win.cury++;
+		return win.cury < LINES ? OK : ERR;
+	}
+	if (c == '\t') {
+		do {
+			if (addch(' ') == ERR)
+				return ERR;
+		} while (win.curx % TABSIZE != 0);
+		return OK;
+	}
+	screen[win.cury][win.curx] = c | attr;
+	if (++win.curx >= COLS) {
+		win.curx = 0;
+		win.cury++;
+	}
+	return win.cury < LINES ? OK : ERR;
+}
+
+int mvaddch(int y, int x, int c)
+{
+	if (move(y, x) == ERR)
+		return ERR;
+	return addch(c);
+}
+
+int addstr(const char *s)
+{
+	while (*s)
+		if (addch((unsigned char)*s++) == ERR)
+			return ERR;
+	return OK;
+}
+
+/* Multibyte characters take a cell each, whatever their real width. */
+int addnstr(const char *s, int n)
+{
+	for (int i = 0; i < n && s[i]; i++) {
+		if (((unsigned char)s[i] & 0xc0) == 0x80)
+			continue;
+		if (addch((unsigned char)s[i]) == ERR)
+			return ERR;
+	}
+	return OK;
+}
+
+int mvaddstr(int y, int x, const char *s)
+{
+	if (move(y, x) == ERR)
+		return ERR;
+	return addstr(s);
+}
+
+/* Like curses, copies the cells as they are and leaves the cursor. */
+int mvaddchnstr(int y, int x, const chtype *cs, int n)
+{
+	if (move(y, x) == ERR)
+		return ERR;
+	for (int i = 0; i < n && x + i < COLS; i++)
+		screen[y][x + i] = cs[i];
+	return OK;
+}
+
+int attron(int a)
+{
+	attr |= a;
+	return OK;
+}
+
+int attroff(int a)
+{
+	attr &= ~a;
+	return OK;
+}
+
+int getch(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	bench_last = ts.tv_sec + ts.tv_nsec / 1e9;
+	if (bench_first == 0)
+		bench_first = bench_last;
+	if (keys && *keys == BENCH_MARK) {
+		bench_mark = bench_last;
+		keys++;
+	}
+	if (keys && *keys)
+		return (unsigned char)*keys++;
+	/* The script should have quit by now; keep asking politely,
+	 * then give up rather than spin forever. */
+	if (overrun++ < 8)
+		return 'q';
+	fprintf(stderr, "bench: key script did not quit\n");
+	exit(1);
+}
+
+void timeout(int ms)
+{
+	(void)ms;
+}
+
+void bench_keys(const char *k)
+{
+	keys = k;
+	overrun = 0;
+	bench_first = bench_last = bench_mark = 0;
+}
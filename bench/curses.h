@@ -0,0 +1,77 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * A headless stand-in for the parts of curses that lwe uses.  The bench
+ * harness builds draw.c, insert.c and lwe.c against this header instead
+ * of the system one.  Output goes to an in-memory screen, and getch
+ * returns keys from a script (see bench_keys).
+ */
+
+/* The real header pulls in stdio, and lwe relies on that. */
+#include <stdio.h>
+
+#define ERR (-1)
+#define OK 0
+#define TRUE 1
+#define FALSE 0
+
+#define KEY_DOWN 0402
+#define KEY_UP 0403
+#define KEY_BACKSPACE 0407
+#define KEY_NPAGE 0522
+#define KEY_PPAGE 0523
+
+#define COLOR_BLACK 0
+#define COLOR_GREEN 2
+#define COLOR_BLUE 4
+#define COLOR_CYAN 6
+#define COLOR_PAIR(n) ((n) << 8)
+
+typedef struct {
+	int cury;
+	int curx;
+} WINDOW;
+
+typedef struct screen SCREEN;
+typedef unsigned chtype;
+
+extern WINDOW *stdscr;
+extern int LINES, COLS, TABSIZE, ESCDELAY;
+
+#define getyx(w, y, x) ((y) = (w)->cury, (x) = (w)->curx)
+
+WINDOW *initscr(void);
+SCREEN *newterm(const char *type, FILE *out, FILE *in);
+int endwin(void);
+int cbreak(void);
+int noecho(void);
+int nonl(void);
+int intrflush(WINDOW *w, int b);
+int keypad(WINDOW *w, int b);
+int define_key(const char *def, int key);
+int start_color(void);
+int init_pair(short pair, short fg, short bg);
+
+int erase(void);
+int refresh(void);
+int move(int y, int x);
+int addch(int c);
+int mvaddch(int y, int x, int c);
+int addstr(const char *s);
+int addnstr(const char *s, int n);
+int mvaddstr(int y, int x, const char *s);
+int mvaddchnstr(int y, int x, const chtype *cs, int n);
+int attron(int a);
+int attroff(int a);
+
+int getch(void);
+/* Keys are always ready, so there's nothing to wait for. */
+void timeout(int ms);
+
+/* Harness side: sets the keys that getch will return, in order.  Once
+ * they run out, getch returns 'q' a few times and then exits.  getch
+ * notes the monotonic time (in seconds) of its first and latest call,
+ * and of the call that reaches a BENCH_MARK, which it skips. */
+#define BENCH_MARK '\001'
+void bench_keys(const char *keys);
+extern double bench_first, bench_last, bench_mark;
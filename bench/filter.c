@@ -0,0 +1,147 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Compares the filters built into `!` with the programs they replace, on
+ * the same lines: the builtin runs in this process, the program through
+ * bang, which starts a shell and pipes the lines both ways.  The :
+ * filters, having no program of their own, are set against the sed
+ * commands that do the same.  The two outputs must agree.
+ *
+ *	usage: filter [lines] [runs]
+ *
+ * The default is a million lines of generated log, and the median of 3
+ * runs.  Both sides run in the C locale, so sort compares bytes.
+ */
+
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bang.h"
+#include "../filter.h"
+
+#define MAXRUNS 256
+
+static char *tests[][2] = {
+	{ "sort", "sort" },
+	{ "sort -u", "sort -u" },
+	{ "sort -r", "sort -r" },
+	{ "uniq", "uniq" },
+	{ "tac", "tac" },
+	{ ":indent", "sed '/./s/^/\\t/'" },
+	{ ":indent -1", "sed 's/^[ \\t]//'" },
+	{ ":trim", "sed 's/[ \\t]*$//'" },
+	{ NULL, NULL }
+};
+
+static double now(void);
+static int cmpd(const void *a, const void *b);
+static char *mklines(size_t n, size_t *len);
+static void measure(char *builtin, char *cmd, char *text, size_t len,
+                    int runs);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpd(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Makes n lines of log, some indented, some with trailing blanks and
+ * some repeated, always the same for a given n. */
+static char *mklines(size_t n, size_t *len)
+{
+	static char *procs[] = { "sshd", "cron", "kernel", "nginx", "smtpd" };
+	static char *words[] = { "accepted", "failed", "closed", "timeout" };
+	char *buf, *p;
+	unsigned x = 1;
+	size_t i;
+	if (!(buf = malloc(n * 96 + 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (p = buf, i = 0; i < n; i++) {
+		x = x * 1103515245 + 12345;
+		if (x >> 20 & 1)
+			*p++ = '\t';
+		if ((x >> 16 & 15) == 0) {
+			/* Repeat the line before. */
+			p += sprintf(p, "%s", "  last message repeated\n");
+			continue;
+		}
+		p += sprintf(p, "Oct %2u %02u:%02u:%02u %s[%u]: %s %u from "
+		             "10.0.%u.%u%s\n", x % 31 + 1, x % 24, x % 60,
+		             (x >> 8) % 60, procs[x % 5], x % 30000,
+		             words[x >> 4 & 3], x, x >> 8 & 255, x & 255,
+		             x >> 21 & 1 ? "   " : "");
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static void measure(char *builtin, char *cmd, char *text, size_t len,
+                    int runs)
+{
+	double in[MAXRUNS], ex[MAXRUNS], t;
+	struct bang_output a, b, e;
+	int i, same = 1;
+	for (i = 0; i < runs; i++) {
+		t = now();
+		if (runfilter(&a, builtin, text, len) != 1) {
+			fprintf(stderr, "%s: not a builtin\n", builtin);
+			exit(1);
+		}
+		in[i] = now() - t;
+		t = now();
+		if (bang(&b, &e, cmd, text, len) < 0) {
+			fprintf(stderr, "%s: failed\n", cmd);
+			exit(1);
+		}
+		ex[i] = now() - t;
+		same &= a.sz == b.sz && !memcmp(a.buf, b.buf, a.sz);
+		free(a.buf);
+		free(b.buf);
+		free(e.buf);
+	}
+	if (!same) {
+		fprintf(stderr, "%s: output differs from %s\n", builtin, cmd);
+		exit(1);
+	}
+	qsort(in, runs, sizeof(double), cmpd);
+	qsort(ex, runs, sizeof(double), cmpd);
+	printf("%-12s %-20s %10.1f %10.1f %8.1fx\n", builtin, cmd,
+	       in[runs / 2] * 1e3, ex[runs / 2] * 1e3,
+	       ex[runs / 2] / in[runs / 2]);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000, len;
+	int runs = argc > 2 ? atoi(argv[2]) : 3, i;
+	char *text;
+	if (n == 0 || runs < 1 || runs > MAXRUNS) {
+		fprintf(stderr, "usage: filter [lines] [runs]\n");
+		return 1;
+	}
+	setenv("LC_ALL", "C", 1);
+	setlocale(LC_ALL, "");
+	text = mklines(n, &len);
+	printf("%zu lines (%.1f MB), %ld processors, median of %d (ms)\n", n,
+	       len / 1048576.0, sysconf(_SC_NPROCESSORS_ONLN), runs);
+	printf("%-12s %-20s %10s %10s %9s\n", "builtin", "program", "builtin",
+	       "program", "speedup");
+	for (i = 0; tests[i][0]; i++)
+		measure(tests[i][0], tests[i][1], text, len, runs);
+	free(text);
+	return 0;
+}
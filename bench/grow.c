@@ -0,0 +1,139 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Grows a buffer a megabyte at a time, the way a stream or a long paste
+ * does, and reports the time taken and the peak resident memory.  Then
+ * it deletes nine tenths of the text and reports what's still resident.
+ * lwe's buffer is measured against what it used to do: double a malloc
+ * block with realloc, and keep it at its high-water mark.  Each runs in
+ * its own process, so the peaks don't mix.
+ *
+ *	usage: grow [MB]
+ *
+ * The default is 8192 MB, which needs that much free memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../buffer.h"
+
+#define CHUNK (1 << 20)
+
+static double now(void);
+static size_t rss(void);
+static void report(char *label, double secs, size_t after);
+static void growmalloc(size_t mb, char *chunk);
+static void growbuffer(size_t mb, char *chunk);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The resident set now, in bytes. */
+static size_t rss(void)
+{
+	unsigned long size, res = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &res) != 2)
+			res = 0;
+		fclose(f);
+	}
+	return res * sysconf(_SC_PAGESIZE);
+}
+
+static void report(char *label, double secs, size_t after)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-8s %10.0f %12.0f %12.0f %10ld\n", label, secs * 1e3,
+	       ru.ru_maxrss / 1024.0, after / 1048576.0, ru.ru_minflt);
+}
+
+static void growmalloc(size_t mb, char *chunk)
+{
+	size_t alloc = 4096, content = 0, i;
+	char *data = malloc(alloc), *p;
+	double t = now();
+	for (i = 0; i < mb; i++) {
+		while (alloc - content <= CHUNK) {
+			if (!(p = realloc(data, alloc * 2))) {
+				perror("realloc");
+				exit(1);
+			}
+			data = p;
+			alloc *= 2;
+		}
+		memcpy(data + content, chunk, CHUNK);
+		content += CHUNK;
+	}
+	t = now() - t;
+	memmove(data, data + content / 10 * 9, content / 10);
+	content /= 10;
+	report("realloc", t, rss());
+	free(data);
+}
+
+static void growbuffer(size_t mb, char *chunk)
+{
+	struct buffer *b;
+	size_t i;
+	double t;
+	if (!(b = bufopen("-"))) {
+		fprintf(stderr, "bufopen failed\n");
+		exit(1);
+	}
+	t = now();
+	for (i = 0; i < mb; i++) {
+		if (bufappend(b, chunk, CHUNK) < 0) {
+			fprintf(stderr, "bufappend failed\n");
+			exit(1);
+		}
+	}
+	t = now() - t;
+	bufdelete(getbufstart(), getbufstart() + (getbufend() -
+	          getbufstart()) / 10 * 9);
+	report("buffer", t, rss());
+	bufclose(b);
+}
+
+int main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 8192;
+	char *chunk = malloc(CHUNK);
+	int i, st;
+	if (!chunk || mb == 0) {
+		fprintf(stderr, "usage: grow [MB]\n");
+		return 1;
+	}
+	memset(chunk, 'x', CHUNK - 1);
+	chunk[CHUNK - 1] = '\n';
+	printf("growing to %zu MB in 1 MB appends\n", mb);
+	printf("%-8s %10s %12s %12s %10s\n", "", "ms", "peak MB",
+	       "after del MB", "faults");
+	fflush(stdout);
+	for (i = 0; i < 2; i++) {
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			return 1;
+		case 0:
+			if (i == 0)
+				growmalloc(mb, chunk);
+			else
+				growbuffer(mb, chunk);
+			return 0;
+		}
+		wait(&st);
+	}
+	return 0;
+}
@@ -0,0 +1,226 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Compares lwe's regex engine with the C library's regexec on the job
+ * search does: finding the lines that match.  The corpus is a generated
+ * log, one line per event in the usual syslog shape, and each pattern
+ * is timed counting its matching lines with refind and with a regexec
+ * per line.  The two counts must agree.  A second set of patterns runs
+ * on a single long line, where backtracking matchers come unstuck.
+ *
+ *	usage: regex [runs]
+ *
+ * BENCH_REGEX_MB sets the size of the log (default 64) and
+ * BENCH_REGEX_LINE the length of the long line in KB (default 64).
+ */
+
+#define _GNU_SOURCE
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../re.h"
+
+#define MAXRUNS 256
+
+static char *logpats[] = {
+	"sshd",
+	"Failed password for (invalid user )?[a-z]+",
+	"^Oct [0-9]+ 0[0-3]:",
+	"port (22|2222) ssh2$",
+	"[0-9]+\\.[0-9]+\\.[0-9]+\\.255",
+	"(error|warn|crit)[a-z]*: .* in [0-9]{4} ms",
+	"kernel: .*[Oo]ut of memory",
+	"zzzz",
+	NULL
+};
+
+static char *longpats[] = {
+	"(a|aa)*b",
+	"(a*)*b",
+	"(a|b|ab)*c",
+	"a.*a.*a.*a.*b",
+	"(x+x+)+y",
+	NULL
+};
+
+static double now(void);
+static int cmpd(const void *a, const void *b);
+static char *mklog(size_t sz, size_t *len);
+static char *mklong(size_t sz);
+static size_t relines(struct re *re, char *p, char *end);
+static size_t libclines(regex_t *reg, char *p, char *end);
+static void measure(char *pat, char *text, size_t len, int runs);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpd(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Makes about sz bytes of log, always the same for a given size. */
+static char *mklog(size_t sz, size_t *len)
+{
+	static char *procs[] = {
+		"sshd", "cron", "kernel", "systemd", "postfix/smtpd", "nginx"
+	};
+	static char *users[] = { "root", "admin", "oracle", "tom", "git" };
+	static char *levels[] = { "info", "warning", "error", "critical" };
+	char *buf, *p;
+	unsigned x = 1;
+	int n;
+	if (!(buf = malloc(sz + 256))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (p = buf; p < buf + sz; p += n) {
+		x = x * 1103515245 + 12345;
+		switch (x >> 16 & 7) {
+		case 0:
+		case 1:
+			n = sprintf(p, "Oct %2u %02u:%02u:%02u gw sshd[%u]: "
+			            "Failed password for %s%s from "
+			            "10.%u.%u.%u port %u ssh2\n",
+			            x % 31 + 1, x % 24, x % 60, (x >> 8) % 60,
+			            x % 30000, x & 1 ? "invalid user " : "",
+			            users[x % 5], x >> 8 & 255, x >> 4 & 255,
+			            x & 255, x & 2 ? 22 : 40000 + x % 20000);
+			break;
+		case 2:
+			n = sprintf(p, "Oct %2u %02u:%02u:%02u gw kernel: "
+			            "[%u.%06u] eth0: link up, 1000Mbps\n",
+			            x % 31 + 1, x % 24, x % 60, (x >> 8) % 60,
+			            x % 100000, x % 1000000);
+			break;
+		default:
+			n = sprintf(p, "Oct %2u %02u:%02u:%02u gw %s[%u]: "
+			            "%s: request %u from 192.168.%u.%u done "
+			            "in %u ms\n",
+			            x % 31 + 1, x % 24, x % 60, (x >> 8) % 60,
+			            procs[x % 6], x % 30000, levels[x >> 3 & 3],
+			            x, x >> 8 & 255, x & 255, x % 5000);
+			break;
+		}
+	}
+	*len = p - buf;
+	return buf;
+}
+
+/* Makes a line of sz bytes of 'a', which none of longpats match. */
+static char *mklong(size_t sz)
+{
+	char *buf;
+	if (!(buf = malloc(sz + 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(buf, 'a', sz);
+	buf[sz] = '\n';
+	return buf;
+}
+
+static size_t relines(struct re *re, char *p, char *end)
+{
+	size_t n = 0;
+	char *e;
+	while ((p = refind(re, p, end))) {
+		n++;
+		if (!(e = memchr(p, '\n', end - p)))
+			break;
+		p = e + 1;
+	}
+	return n;
+}
+
+/* What search used to do: a regexec on each line in turn. */
+static size_t libclines(regex_t *reg, char *p, char *end)
+{
+	regmatch_t m;
+	size_t n = 0;
+	char *e;
+	for (; p < end; p = e + 1) {
+		if (!(e = memchr(p, '\n', end - p)))
+			e = end;
+		m.rm_so = 0;
+		m.rm_eo = e - p;
+		if (regexec(reg, p, 1, &m, REG_STARTEND) == 0)
+			n++;
+	}
+	return n;
+}
+
+static void measure(char *pat, char *text, size_t len, int runs)
+{
+	double lwe[MAXRUNS], libc[MAXRUNS], t;
+	char err[256];
+	struct re *re;
+	regex_t reg;
+	size_t a = 0, b = 0;
+	int i;
+	if (!(re = recomp(pat, err, sizeof(err)))) {
+		fprintf(stderr, "%s: %s\n", pat, err);
+		exit(1);
+	}
+	if (regcomp(&reg, pat, REG_EXTENDED | REG_NOSUB)) {
+		fprintf(stderr, "%s: regcomp failed\n", pat);
+		exit(1);
+	}
+	for (i = 0; i < runs; i++) {
+		t = now();
+		a = relines(re, text, text + len);
+		lwe[i] = now() - t;
+		t = now();
+		b = libclines(&reg, text, text + len);
+		libc[i] = now() - t;
+	}
+	if (a != b) {
+		fprintf(stderr, "%s: %zu lines, regexec says %zu\n", pat, a, b);
+		exit(1);
+	}
+	qsort(lwe, runs, sizeof(double), cmpd);
+	qsort(libc, runs, sizeof(double), cmpd);
+	printf("%-44s %9zu %10.2f %10.2f %8.1fx\n", pat, a,
+	       lwe[runs / 2] * 1e3, libc[runs / 2] * 1e3,
+	       libc[runs / 2] / lwe[runs / 2]);
+	regfree(&reg);
+	refree(re);
+}
+
+int main(int argc, char **argv)
+{
+	char *s, *text;
+	size_t mb = 64, kb = 64, len;
+	int i, runs = 3;
+	if (argc > 1)
+		runs = atoi(argv[1]);
+	if (runs < 1 || runs > MAXRUNS) {
+		fprintf(stderr, "usage: regex [runs]\n");
+		return 1;
+	}
+	if ((s = getenv("BENCH_REGEX_MB")))
+		mb = strtoul(s, NULL, 10);
+	if ((s = getenv("BENCH_REGEX_LINE")))
+		kb = strtoul(s, NULL, 10);
+	text = mklog(mb << 20, &len);
+	printf("%zu MB of log, median of %d (ms)\n", mb, runs);
+	printf("%-44s %9s %10s %10s %9s\n", "pattern", "lines", "lwe",
+	       "regexec", "speedup");
+	for (i = 0; logpats[i]; i++)
+		measure(logpats[i], text, len, runs);
+	free(text);
+	text = mklong(kb << 10);
+	printf("\none line of %zu KB\n", kb);
+	for (i = 0; longpats[i]; i++)
+		measure(longpats[i], text, (kb << 10) + 1, runs);
+	free(text);
+	return 0;
+}
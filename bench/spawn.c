@@ -0,0 +1,151 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Times starting a shell command the way bang does, with a line of input
+ * and a line of output, while the editor holds a bigger and bigger
+ * buffer.  bang's posix_spawn is measured against what it used to do:
+ * fork, then exec the shell in the child, which has to copy the page
+ * tables of everything the editor has mapped first.
+ *
+ *	usage: spawn [MB] [runs]
+ *
+ * The buffer goes from 1 MB up to MB (default 4096, which needs that
+ * much free memory), and each time is the median of runs (default 20).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../bang.h"
+#include "../buffer.h"
+
+#define CHUNK (1 << 20)
+#define MAXRUNS 256
+#define CMD "read x; echo \"$x\""
+
+static double now(void);
+static int cmpd(const void *a, const void *b);
+static int forkrun(char *cmd, char *input, int sz);
+static int spawnrun(char *cmd, char *input, int sz);
+static double median(int (*run)(char *, char *, int), int runs);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpd(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* What bang did before: fork and exec, write the input, read the output
+ * and wait. */
+static int forkrun(char *cmd, char *input, int sz)
+{
+	int in[2], out[2], st;
+	char buf[4096];
+	pid_t pid;
+	if (pipe(in) < 0 || pipe(out) < 0)
+		return -1;
+	if ((pid = fork()) < 0) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		close(in[1]);
+		close(out[0]);
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		execl("/bin/sh", "/bin/sh", "-c", cmd, NULL);
+		_exit(127);
+	}
+	close(in[0]);
+	close(out[1]);
+	if (write(in[1], input, sz) != sz)
+		return -1;
+	close(in[1]);
+	while (read(out[0], buf, sizeof(buf)) > 0)
+		;
+	close(out[0]);
+	waitpid(pid, &st, 0);
+	return 0;
+}
+
+static int spawnrun(char *cmd, char *input, int sz)
+{
+	struct bang_output o, e;
+	int r = bang(&o, &e, cmd, input, sz);
+	free(o.buf);
+	free(e.buf);
+	return r;
+}
+
+/* The median time of runs, or -1 if any failed. */
+static double median(int (*run)(char *, char *, int), int runs)
+{
+	double t[MAXRUNS];
+	int i;
+	for (i = 0; i < runs; i++) {
+		t[i] = now();
+		if (run(CMD, "x\n", 2) < 0)
+			return -1;
+		t[i] = now() - t[i];
+	}
+	qsort(t, runs, sizeof(double), cmpd);
+	return t[runs / 2];
+}
+
+int main(int argc, char **argv)
+{
+	size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 4096, have = 0;
+	int runs = argc > 2 ? atoi(argv[2]) : 20;
+	char *chunk = malloc(CHUNK);
+	struct buffer *b;
+	double f, s;
+	size_t want;
+	if (!chunk || mb == 0 || runs < 1 || runs > MAXRUNS) {
+		fprintf(stderr, "usage: spawn [MB] [runs]\n");
+		return 1;
+	}
+	if (!(b = bufopen("-"))) {
+		fprintf(stderr, "bufopen failed\n");
+		return 1;
+	}
+	memset(chunk, 'x', CHUNK - 1);
+	chunk[CHUNK - 1] = '\n';
+	printf("starting `%s`, median of %d (ms)\n", CMD, runs);
+	printf("%8s %10s %10s %9s\n", "MB", "fork", "spawn", "speedup");
+	for (want = 1; ; want *= 4) {
+		if (want > mb)
+			want = mb;
+		for (; have < want; have++) {
+			if (bufappend(b, chunk, CHUNK) < 0) {
+				fprintf(stderr, "bufappend failed\n");
+				return 1;
+			}
+		}
+		f = median(forkrun, runs);
+		s = median(spawnrun, runs);
+		if (f < 0)
+			printf("%8zu %10s %10.2f %9s\n", have, "fails", s * 1e3, "");
+		else
+			printf("%8zu %10.2f %10.2f %8.1fx\n", have, f * 1e3,
+			       s * 1e3, f / s);
+		fflush(stdout);
+		if (want == mb)
+			break;
+	}
+	bufclose(b);
+	return 0;
+}
@@ -0,0 +1,176 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Measures lwe's time to first frame.  lwe is started on a pseudo
+ * terminal with a small file (the size of a commit message), and the
+ * clock stops when the modeline of the first frame arrives on the
+ * terminal.  This is repeated with an empty, a small and a huge yank
+ * file in a scratch TMPDIR, so the user's own yank file isn't touched.
+ *
+ *	usage: startup path/to/lwe [runs]
+ *
+ * BENCH_YANK_MB sets the size of each entry in the huge yank file
+ * (default 8, for 26 entries).
+ */
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../yank.h"
+
+#define NYANKS 26
+#define MAXRUNS 256
+
+static char dir[] = "/tmp/lwe_startup_XXXXXX";
+static char textpath[64];
+
+static double now(void);
+static int cmpd(const void *a, const void *b);
+static void mkyanks(int n, size_t sz);
+static double firstframe(char *lwe);
+static void measure(char *lwe, char *label, int runs);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpd(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Writes a yank file of n entries of sz bytes each, using lwe's own
+ * yank code so the format always matches. */
+static void mkyanks(int n, size_t sz)
+{
+	char *p;
+	if (!(p = malloc(sz ? sz : 1))) {
+		perror("malloc");
+		exit(1);
+	}
+	for (size_t i = 0; i < sz; i++)
+		p[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+	for (int i = 0; i < n; i++)
+		yank_store(p, p + sz);
+	free(p);
+	if (saveyanks() < 0) {
+		perror("saveyanks");
+		exit(1);
+	}
+}
+
+/* Starts lwe on a pty and returns the seconds until its first frame. */
+static double firstframe(char *lwe)
+{
+	struct winsize ws = { .ws_row = 50, .ws_col = 160 };
+	char buf[65536 + 4];
+	double start, t = -1;
+	size_t keep = 0;
+	int fd, st;
+	pid_t pid;
+	start = now();
+	pid = forkpty(&fd, NULL, NULL, &ws);
+	if (pid < 0) {
+		perror("forkpty");
+		exit(1);
+	}
+	if (pid == 0) {
+		setenv("TERM", "xterm", 1);
+		execl(lwe, lwe, textpath, (char *)NULL);
+		_exit(127);
+	}
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll(&pfd, 1, 5000) <= 0)
+			break;
+		/* Keep the tail of the last read, since the marker may be
+		 * split across reads. */
+		ssize_t r = read(fd, buf + keep, sizeof(buf) - keep - 1);
+		if (r <= 0)
+			break;
+		buf[keep + r] = '\0';
+		if (strstr(buf, "[F: ")) {
+			t = now() - start;
+			break;
+		}
+		size_t n = keep + r;
+		keep = n < 3 ? n : 3;
+		memmove(buf, buf + n - keep, keep);
+	}
+	if (write(fd, "q", 1) < 0 || t < 0)
+		kill(pid, SIGKILL);
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	waitpid(pid, &st, 0);
+	close(fd);
+	return t;
+}
+
+static void measure(char *lwe, char *label, int runs)
+{
+	double t[MAXRUNS];
+	for (int i = 0; i < runs; i++) {
+		if ((t[i] = firstframe(lwe)) < 0) {
+			fprintf(stderr, "%s: no frame from %s\n", label, lwe);
+			exit(1);
+		}
+	}
+	qsort(t, runs, sizeof(t[0]), cmpd);
+	printf("%-24s min %8.3f ms  median %8.3f ms  max %8.3f ms\n",
+	       label, t[0] * 1e3, t[runs / 2] * 1e3, t[runs - 1] * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+	char label[64], cmd[128];
+	size_t mb = 8;
+	int runs = 20;
+	FILE *f;
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s path/to/lwe [runs]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		runs = atoi(argv[2]);
+	if (runs < 1 || runs > MAXRUNS)
+		runs = 20;
+	if (getenv("BENCH_YANK_MB"))
+		mb = strtoul(getenv("BENCH_YANK_MB"), NULL, 10);
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	setenv("TMPDIR", dir, 1);
+	snprintf(textpath, sizeof(textpath), "%s/COMMIT_EDITMSG", dir);
+	if (!(f = fopen(textpath, "w"))) {
+		perror(textpath);
+		return 1;
+	}
+	fputs("Fix the frobnicator\n\n# Please enter the commit message.\n", f);
+	fclose(f);
+
+	printf("time to first frame, %d runs each\n", runs);
+	measure(argv[1], "no yank file", runs);
+	mkyanks(NYANKS, 64);
+	measure(argv[1], "small yank file", runs);
+	mkyanks(NYANKS, mb << 20);
+	snprintf(label, sizeof(label), "huge yank file (%zu MB)", NYANKS * mb);
+	measure(argv[1], label, runs);
+
+	snprintf(cmd, sizeof(cmd), "rm -rf '%s'", dir);
+	if (system(cmd) != 0)
+		fprintf(stderr, "could not remove %s\n", dir);
+	return 0;
+}
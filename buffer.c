@@ -1,151 +1,489 @@
 /* buffer.c (c) 2015 Tom Wright */
 
+#define _GNU_SOURCE	/* mremap */
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "buffer.h"
 #include "err.h"
+#include "stats.h"
+#include "undo.h"
+#include "trace.h"
 
-static char *buffer;
-static int allocatedsz, contentsz;
+struct buffer {
+	char *path;
+	char *data;
+	size_t allocated, content;
+	int mapped;	/* data is a read-only mapping of the file */
+	struct undo *undo;
+	struct scroll scroll;
+};
 
-static int initbuf(int sz);
-static int filetobuf(char *path, int sz);
-static int overalloc_sz(void);
+/* The buffer every function below works on. */
+static struct buffer *cur;
+static unsigned long gen;
+
+/* Text is kept in an anonymous mapping rather than on the heap, so
+ * growing it moves page tables instead of bytes, whatever the malloc.
+ * Mappings this big are backed by huge pages where the system has them,
+ * and a delete this big hands the pages it emptied back.  A mapping that
+ * the text fills less than a quarter of is halved until it fills more,
+ * which grows back only by doubling, so the two can't see-saw. */
+#define HUGESZ (2 << 20)
+#define RELEASESZ (1 << 20)
+
+static size_t pageup(size_t sz);
+static char *mapalloc(size_t sz);
+static char *mapgrow(char *p, size_t oldsz, size_t newsz);
+static void reclaim(struct buffer *b, size_t oldcontent);
+static int initbuf(struct buffer *b, size_t sz);
+static int filetobuf(struct buffer *b, size_t sz);
+static size_t overalloc_sz(void);
+static int grow(struct buffer *b, size_t newsize);
 static int bufextend(void);
+static int readfile(struct buffer *b);
+static int mapfile(struct buffer *b);
+
+static size_t pageup(size_t sz)
+{
+	size_t pg = sysconf(_SC_PAGESIZE);
+	return (sz + pg - 1) / pg * pg;
+}
+
+static char *mapalloc(size_t sz)
+{
+	char *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (sz >= HUGESZ)
+		madvise(p, sz, MADV_HUGEPAGE);
+#endif
+	return p;
+}
+
+static char *mapgrow(char *p, size_t oldsz, size_t newsz)
+{
+	char *q;
+#ifdef MREMAP_MAYMOVE
+	if ((q = mremap(p, oldsz, newsz, MREMAP_MAYMOVE)) == MAP_FAILED)
+		return NULL;
+#ifdef MADV_HUGEPAGE
+	if (newsz >= HUGESZ)
+		madvise(q, newsz, MADV_HUGEPAGE);
+#endif
+#else
+	if (!(q = mapalloc(newsz)))
+		return NULL;
+	memcpy(q, p, oldsz);
+	munmap(p, oldsz);
+#endif
+	return q;
+}
 
-static int initbuf(int sz)
+/* Shrinks the mapping after a delete if the text has fallen well below
+ * it, then gives back the whole pages between the end of the text and
+ * where it ended before.  They stay mapped, and come back as zeroes if
+ * the text grows into them again. */
+static void reclaim(struct buffer *b, size_t oldcontent)
 {
-	allocatedsz = sz + 4096;
-	contentsz = 0;
-	buffer = malloc(allocatedsz);
-	if (buffer == NULL) {
+	size_t newsize, from, to;
+	for (newsize = b->allocated; newsize / 4 > b->content &&
+	     newsize / 2 >= RELEASESZ;)
+		newsize /= 2;
+	newsize = pageup(newsize);
+	if (newsize < b->allocated &&
+	    munmap(b->data + newsize, b->allocated - newsize) == 0) {
+		stats.shrinks++;
+		memsub(&stats.allocated, b->allocated - newsize);
+		b->allocated = newsize;
+	}
+	from = pageup(b->content + 1);
+	to = pageup(oldcontent);
+	if (to > b->allocated)
+		to = b->allocated;
+	if (to < from + RELEASESZ)
+		return;
+	if (madvise(b->data + from, to - from, MADV_DONTNEED) == 0)
+		stats.released += to - from;
+}
+
+static int initbuf(struct buffer *b, size_t sz)
+{
+	b->allocated = pageup(sz + 4096);
+	b->content = 0;
+	b->data = mapalloc(b->allocated);
+	if (b->data == NULL) {
 		seterr("memory");
 		return -1;
 	}
+	memadd(&stats.allocated, b->allocated);
 	return 0;
 }
 
-static int filetobuf(char *path, int sz)
+static int filetobuf(struct buffer *b, size_t sz)
 {
-	FILE *f = fopen(path, "r");
+	FILE *f = fopen(b->path, "r");
 	if (f == NULL) {
 		seterr("read");
 		return -1;
 	}
-	int readsz = fread(buffer, 1, sz, f);
+	size_t readsz = fread(b->data, 1, sz, f);
 	if (readsz != sz) {
 		seterr("read");
 		fclose(f);
 		return -1;
 	}
-	contentsz += sz;
+	b->content += sz;
 	fclose(f);
 	return 0;
 }
 
-static int overalloc_sz(void)
+static size_t overalloc_sz(void)
 {
-	return allocatedsz - contentsz;
+	return cur->allocated - cur->content;
 }
 
-static int bufextend(void)
+static int grow(struct buffer *b, size_t newsize)
 {
-	int newsize = allocatedsz * 2;
-	buffer = realloc(buffer, newsize);
-	if (buffer == NULL) {
+	char *data;
+	newsize = pageup(newsize);
+	if (!(data = mapgrow(b->data, b->allocated, newsize))) {
 		seterr("memory");
 		return -1;
 	}
-	allocatedsz = newsize;
+	stats.extends++;
+	stats.extended += newsize;
+	memadd(&stats.allocated, newsize - b->allocated);
+	b->data = data;
+	b->allocated = newsize;
 	return 0;
 }
 
-int bufread(char *path)
+static int bufextend(void)
+{
+	return grow(cur, cur->allocated * 2);
+}
+
+static int readfile(struct buffer *b)
 {
-	if (buffer != NULL)
-		free(buffer);
 	struct stat st;
+	/* Standard input and FIFOs start empty and are streamed in. */
+	if (strcmp(b->path, "-") == 0)
+		return initbuf(b, 0);
 	errno = 0;
-	stat(path, &st);
-	if (errno == 0) {
-		if (initbuf(st.st_size) < 0)
+	stat(b->path, &st);
+	if (errno == 0 && S_ISFIFO(st.st_mode)) {
+		return initbuf(b, 0);
+	} else if (errno == 0) {
+		if (initbuf(b, st.st_size) < 0)
 			return -1;
-		return filetobuf(path, st.st_size);
+		return filetobuf(b, st.st_size);
 	} else if (errno == ENOENT) {
-		return initbuf(0);
+		return initbuf(b, 0);
 	} else {
 		seterr(strerror(errno));
 		return -1;
 	}
 }
 
+/* Maps the file read-only in place of reading it.  An empty file can't
+ * be mapped, so it gets an ordinary (empty) allocation. */
+static int mapfile(struct buffer *b)
+{
+	struct stat st;
+	int fd = open(b->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		seterr(strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		return initbuf(b, 0);
+	}
+	b->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (b->data == MAP_FAILED) {
+		b->data = NULL;
+		seterr(strerror(errno));
+		return -1;
+	}
+	b->content = st.st_size;
+	b->mapped = 1;
+	stats.mapped += b->content;
+	return 0;
+}
+
+struct buffer *bufopen(char *path)
+{
+	struct buffer *b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		seterr("memory");
+		return NULL;
+	}
+	b->path = path;
+	if (!(b->undo = undonew())) {
+		seterr("memory");
+		bufclose(b);
+		return NULL;
+	}
+	if (readfile(b) < 0) {
+		bufclose(b);
+		return NULL;
+	}
+	cur = b;
+	return b;
+}
+
+struct buffer *bufview(char *path)
+{
+	struct buffer *b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		seterr("memory");
+		return NULL;
+	}
+	b->path = path;
+	if (mapfile(b) < 0) {
+		bufclose(b);
+		return NULL;
+	}
+	cur = b;
+	return b;
+}
+
+void bufclose(struct buffer *b)
+{
+	if (b == NULL)
+		return;
+	undofree(b->undo);
+	free(b->scroll.marks);
+	if (b->mapped) {
+		stats.mapped -= b->content;
+		munmap(b->data, b->content);
+	} else if (b->data) {
+		memsub(&stats.allocated, b->allocated);
+		munmap(b->data, b->allocated);
+	}
+	free(b);
+	if (cur == b)
+		cur = NULL;
+}
+
+void bufselect(struct buffer *b)
+{
+	cur = b;
+}
+
+struct buffer *bufcurrent(void)
+{
+	return cur;
+}
+
+char *bufpath(struct buffer *b)
+{
+	return b->path;
+}
+
+struct undo *bufundo(void)
+{
+	return cur->undo;
+}
+
+struct scroll *bufscroll(void)
+{
+	return &cur->scroll;
+}
+
+unsigned long bufgen(void)
+{
+	return gen;
+}
+
+int bufappend(struct buffer *b, char *data, size_t sz)
+{
+	size_t newsize = b->allocated;
+	assert(!b->mapped);
+	/* Keep at least a byte spare, as bufinsert expects. */
+	while (newsize - b->content <= sz)
+		newsize *= 2;
+	if (newsize != b->allocated && grow(b, newsize) < 0)
+		return -1;
+	memcpy(b->data + b->content, data, sz);
+	b->content += sz;
+	gen++;
+	return 0;
+}
+
 int bufwrite(char *path)
 {
+	if (strcmp(path, "-") == 0)
+		return -1;
 	FILE *f = fopen(path, "w");
 	if (f == NULL)
 		return -1;
-	fwrite(buffer, 1, contentsz, f);
+	fwrite(cur->data, 1, cur->content, f);
 	fclose(f);
 	return 0;
 }
 
 char *bufinsert(char c, char *t)
 {
-	size_t sztomove;
-	unsigned o;
+	size_t sztomove, o;
+	TRACE_ENTER(TRACE_EDIT);
 	assert(inbuf(t));
 	assert(overalloc_sz() > 0);
-	o = t - buffer;
-	sztomove = contentsz - o;
+	o = t - cur->data;
+	sztomove = cur->content - o;
 	memmove(t + 1, t, sztomove);
+	stats.moved += sztomove;
 	*t = c;
-	contentsz++;
-	if (overalloc_sz() == 0) {
-		if (bufextend() < 0)
-			return NULL;
-		else
-			return buffer + o;
-	} else {
-		return t;
-	}
+	cur->content++;
+	gen++;
+	if (overalloc_sz() == 0)
+		t = bufextend() < 0 ? NULL : cur->data + o;
+	TRACE_LEAVE();
+	return t;
 }
 
+/* Makes room for the whole string first, so the text after t moves once
+ * however long the string is. */
 char *bufinsertstr(char *start, char *end, char *t)
 {
-	char *i;
-	unsigned d;
+	size_t sz = end - start, o, newsize;
+	TRACE_ENTER(TRACE_EDIT);
 	assert(inbuf(t));
 	assert(end >= start);
-	for (i = start; i < end; i++, t++)
-		if (!(t = bufinsert(*i, t)))
-			return t;
-	d = end - start;
-	return t - d;
+	o = t - cur->data;
+	/* Keep at least a byte spare, as bufinsert expects. */
+	for (newsize = cur->allocated; newsize - cur->content <= sz;)
+		newsize *= 2;
+	if (newsize != cur->allocated && grow(cur, newsize) < 0) {
+		TRACE_LEAVE();
+		return NULL;
+	}
+	t = cur->data + o;
+	memmove(t + sz, t, cur->content - o);
+	stats.moved += cur->content - o;
+	memcpy(t, start, sz);
+	cur->content += sz;
+	gen++;
+	TRACE_LEAVE();
+	return t;
 }
 
 void bufdelete(char *start, char *end)
 {
+	TRACE_ENTER(TRACE_EDIT);
 	assert(end >= start);
 	assert(inbuf(start) && inbuf(end));
-	int sztomove = buffer + contentsz - end;
-	int szdeleted = end - start;
+	size_t sztomove = getbufend() - end;
+	size_t szdeleted = end - start;
 	memmove(start, end, sztomove);
-	contentsz -= szdeleted;
+	stats.moved += sztomove;
+	cur->content -= szdeleted;
+	gen++;
+	reclaim(cur, cur->content + szdeleted);
+	TRACE_LEAVE();
+}
+
+char *bufsplice(char *start, char *end, char *data, size_t sz)
+{
+	size_t o, e, newsize, old;
+	TRACE_ENTER(TRACE_EDIT);
+	assert(inbuf(start) && inbuf(end) && end >= start);
+	o = start - cur->data;
+	e = end - cur->data;
+	/* Keep at least a byte spare, as bufinsert expects. */
+	for (newsize = cur->allocated; newsize - cur->content + (e - o) <= sz;)
+		newsize *= 2;
+	if (newsize != cur->allocated && grow(cur, newsize) < 0) {
+		TRACE_LEAVE();
+		return NULL;
+	}
+	start = cur->data + o;
+	memmove(start + sz, cur->data + e, cur->content - e);
+	stats.moved += cur->content - e;
+	if (sz)
+		memcpy(start, data, sz);
+	old = cur->content;
+	cur->content = cur->content - (e - o) + sz;
+	gen++;
+	reclaim(cur, old);
+	TRACE_LEAVE();
+	return start;
+}
+
+int bufpatch(struct patch *p, size_t n)
+{
+	size_t i, newsize, nc = cur->content, old = cur->content, from, to;
+	char *d;
+	long shift = 0;
+	TRACE_ENTER(TRACE_EDIT);
+	for (i = 0; i < n; i++) {
+		assert(p[i].off + p[i].len <= cur->content);
+		assert(i == 0 || p[i].off >= p[i - 1].off + p[i - 1].len);
+		nc = nc - p[i].len + p[i].sz;
+	}
+	for (newsize = cur->allocated; newsize <= nc;)
+		newsize *= 2;
+	if (newsize != cur->allocated && grow(cur, newsize) < 0) {
+		TRACE_LEAVE();
+		return -1;
+	}
+	d = cur->data;
+	/*
+	 * The text after each patch moves by how much it and those before it
+	 * grow.  Moves to the left can't land on text yet to move if they're
+	 * made from the front, nor moves to the right from the back.
+	 */
+	for (i = 0; i < n; i++) {
+		shift += (long)p[i].sz - (long)p[i].len;
+		from = p[i].off + p[i].len;
+		to = i + 1 < n ? p[i + 1].off : cur->content;
+		if (shift < 0 && to > from) {
+			memmove(d + from + shift, d + from, to - from);
+			stats.moved += to - from;
+		}
+	}
+	for (i = n; i-- > 0;) {
+		from = p[i].off + p[i].len;
+		to = i + 1 < n ? p[i + 1].off : cur->content;
+		if (shift > 0 && to > from) {
+			memmove(d + from + shift, d + from, to - from);
+			stats.moved += to - from;
+		}
+		shift -= (long)p[i].sz - (long)p[i].len;
+	}
+	for (i = 0; i < n; i++) {
+		if (p[i].sz)
+			memcpy(d + p[i].off + shift, p[i].data, p[i].sz);
+		shift += (long)p[i].sz - (long)p[i].len;
+	}
+	cur->content = nc;
+	gen++;
+	reclaim(cur, old);
+	TRACE_LEAVE();
+	return 0;
 }
 
 char *getbufstart(void)
 {
-	return buffer;
+	return cur->data;
 }
 
 char *getbufend(void)
 {
-	return buffer + contentsz;
+	return cur->data + cur->content;
 }
 
 char *endofline(char *p)
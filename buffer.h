@@ -1,10 +1,74 @@
 /* buffer.h (c) 2015 Tom Wright */
 
-int bufread(char *path);
+#include <stddef.h>
+
+struct undo;
+
+/*
+ * Every open file has a struct buffer, which also holds the file's undo
+ * history and how far it's scrolled.  One buffer is current at a time,
+ * and the rest of this interface, undo and drawing all act on it.
+ */
+struct buffer;
+
+/* Where the window starts in a buffer: a byte offset and its line.  The
+ * rest is draw.c's, to scroll back through a long line without laying
+ * it out from its start each time: where the line starts, and every
+ * MARKROWS'th row of it as far as it's been laid out, good while the
+ * text (gen) and the width (cols) stay as they were. */
+struct scroll {
+	size_t off;
+	int line;
+	size_t ls, last, lastrow;
+	size_t *marks, nmarks, amarks;
+	unsigned long gen;
+	int cols;
+};
+
+/* Reads `path` (or starts an empty buffer if it doesn't exist) and makes
+ * the new buffer current.  Returns NULL on failure. */
+struct buffer *bufopen(char *path);
+/* Opens `path` read-only, mapping it rather than reading a copy.  The
+ * buffer has no undo history and mustn't be changed. */
+struct buffer *bufview(char *path);
+void bufclose(struct buffer *b);
+void bufselect(struct buffer *b);
+struct buffer *bufcurrent(void);
+char *bufpath(struct buffer *b);
+
+/* The current buffer's undo history and scroll position. */
+struct undo *bufundo(void);
+struct scroll *bufscroll(void);
+/* Counts changes to the text of any buffer, so what's worked out from
+ * the text can tell when it's out of date. */
+unsigned long bufgen(void);
+
+/* Adds data to the end of `b`, which needn't be current, without
+ * recording it for undo.  Returns 0 on success and -1 on failure. */
+int bufappend(struct buffer *b, char *data, size_t sz);
+
 int bufwrite(char *path);
 char *bufinsert(char c, char *t);
 char *bufinsertstr(char *start, char *end, char *t);
 void bufdelete(char *start, char *end);
+/* Replaces [start, end) with sz bytes from data, moving the text after it
+ * once.  Returns the start of the new text, or NULL on failure. */
+char *bufsplice(char *start, char *end, char *data, size_t sz);
+
+/* A replacement for bufpatch: len bytes at offset off become sz bytes
+ * from data, which mustn't be in the buffer. */
+struct patch {
+	size_t off, len;
+	char *data;
+	size_t sz;
+};
+
+/* Makes n replacements at once, in order and not overlapping, with
+ * offsets into the text as it is now.  The text between them moves at
+ * most once and the text after the last once, so a scattered change
+ * costs about what a single one does.  Returns 0 on success and -1 on
+ * failure. */
+int bufpatch(struct patch *p, size_t n);
 char *getbufstart(void);
 char *getbufend(void);
 
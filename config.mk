@@ -1,9 +1,12 @@
-LIBS = -lcurses
-# bsd-compat may be needed on non-bsd systems, if you get link errors
-# for `flock`.
-#LIBS += -lbsd-compat
+# The wide character curses is needed to draw UTF-8.  Plain -lcurses
+# still works, but draws other characters as escapes.
+LIBS = -lncursesw -lpthread
 
 CFLAGS += -g -std=c99 -pedantic -Wall -Wextra -Os -D_DEFAULT_SOURCE
 LDFLAGS += -g ${LIBS}
 
+# Time each key from input to screen, with a histogram on exit or C-t
+# (see trace.h).
+#CFLAGS += -DLWE_TRACE
+
 # CC = cc
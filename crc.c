@@ -0,0 +1,50 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "crc.h"
+
+#define POLY 0x82f63b78u
+
+/* Slicing-by-8 tables, filled on first use. */
+static uint32_t tbl[8][256];
+static int tblready;
+
+static void mktbl(void);
+
+static void mktbl(void)
+{
+	uint32_t c;
+	int i, j;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+		tbl[0][i] = c;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			tbl[j][i] = (tbl[j - 1][i] >> 8) ^ tbl[0][tbl[j - 1][i] & 0xff];
+	tblready = 1;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	if (!tblready)
+		mktbl();
+	crc = ~crc;
+	while (len >= 8) {
+		crc ^= (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+		       (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+		crc = tbl[7][crc & 0xff] ^ tbl[6][(crc >> 8) & 0xff] ^
+		      tbl[5][(crc >> 16) & 0xff] ^ tbl[4][crc >> 24] ^
+		      tbl[3][p[4]] ^ tbl[2][p[5]] ^ tbl[1][p[6]] ^ tbl[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ tbl[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
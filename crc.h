@@ -0,0 +1,10 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli) of `len` bytes at `buf`.  Pass 0 as `crc` to
+ * start a new checksum, or a previous result to continue one.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
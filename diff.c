@@ -0,0 +1,302 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "err.h"
+
+/*
+ * Lines are compared by Myers' greedy algorithm ("An O(ND) Difference
+ * Algorithm and Its Variations", 1986), after trimming what the two texts
+ * have in common at either end.  Its time goes with the number of lines
+ * times the number of differences, and it keeps the frontier of each
+ * round to trace the path back, which costs the square of the number of
+ * differences; past MAXD of them the search stops and the whole middle is
+ * one hunk.
+ */
+#define MAXD 2048
+
+/* The lines of one side, as offsets into its text and hashes. */
+struct lines {
+	char *text;
+	size_t n;
+	size_t *off;
+	uint32_t *hash;
+};
+
+static size_t prefix(char *a, char *b, size_t n);
+static size_t suffix(char *a, char *b, size_t n);
+static uint32_t hashline(char *p, size_t n);
+static int split(struct lines *l, char *p, size_t sz);
+static int same(struct lines *a, size_t i, struct lines *b, size_t j);
+static int addhunk(struct hunk **h, size_t *n, size_t *alloc,
+                   size_t a, size_t na, size_t b, size_t nb);
+static long myers(struct lines *a, struct lines *b, long **trace);
+static int backtrack(struct lines *a, struct lines *b, long d, long *trace,
+                     struct hunk **h, size_t *n);
+
+/* How many bytes a and b start with in common, of n. */
+static size_t prefix(char *a, char *b, size_t n)
+{
+	size_t i = 0;
+	while (n - i >= 4096 && !memcmp(a + i, b + i, 4096))
+		i += 4096;
+	while (i < n && a[i] == b[i])
+		i++;
+	return i;
+}
+
+/* How many bytes the n before a and b have in common at the end. */
+static size_t suffix(char *a, char *b, size_t n)
+{
+	size_t i = 0;
+	while (n - i >= 4096 && !memcmp(a - i - 4096, b - i - 4096, 4096))
+		i += 4096;
+	while (i < n && a[-(long)i - 1] == b[-(long)i - 1])
+		i++;
+	return i;
+}
+
+static uint32_t hashline(char *p, size_t n)
+{
+	uint64_t h = 14695981039346656037u, w;
+	for (; n >= 8; p += 8, n -= 8) {
+		memcpy(&w, p, 8);
+		h = (h ^ w) * 1099511628211u;
+	}
+	while (n--)
+		h = (h ^ (unsigned char)*p++) * 1099511628211u;
+	return h ^ h >> 32;
+}
+
+static int split(struct lines *l, char *p, size_t sz)
+{
+	char *end = p + sz, *e;
+	size_t n = 0, alloc = sz / 32 + 16;
+	void *tmp;
+	l->text = p;
+	l->off = malloc((alloc + 1) * sizeof(*l->off));
+	l->hash = malloc(alloc * sizeof(*l->hash));
+	if (!l->off || !l->hash)
+		goto fail;
+	for (; p < end; p = e, n++) {
+		if (!(e = memchr(p, '\n', end - p)))
+			e = end;
+		else
+			e++;
+		if (n == alloc) {
+			alloc *= 2;
+			tmp = realloc(l->off, (alloc + 1) * sizeof(*l->off));
+			if (!tmp)
+				goto fail;
+			l->off = tmp;
+			if (!(tmp = realloc(l->hash, alloc * sizeof(*l->hash))))
+				goto fail;
+			l->hash = tmp;
+		}
+		l->off[n] = p - l->text;
+		l->hash[n] = hashline(p, e - p);
+	}
+	l->off[n] = sz;
+	l->n = n;
+	return 0;
+fail:
+	free(l->off);
+	free(l->hash);
+	seterr("memory");
+	return -1;
+}
+
+static int same(struct lines *a, size_t i, struct lines *b, size_t j)
+{
+	size_t n = a->off[i + 1] - a->off[i];
+	return a->hash[i] == b->hash[j] && n == b->off[j + 1] - b->off[j] &&
+	       !memcmp(a->text + a->off[i], b->text + b->off[j], n);
+}
+
+static int addhunk(struct hunk **h, size_t *n, size_t *alloc,
+                   size_t a, size_t na, size_t b, size_t nb)
+{
+	struct hunk *tmp;
+	if (*n == *alloc) {
+		*alloc = *alloc ? *alloc * 2 : 16;
+		if (!(tmp = realloc(*h, *alloc * sizeof(**h)))) {
+			seterr("memory");
+			return -1;
+		}
+		*h = tmp;
+	}
+	(*h)[*n].a = a;
+	(*h)[*n].na = na;
+	(*h)[*n].b = b;
+	(*h)[*n].nb = nb;
+	(*n)++;
+	return 0;
+}
+
+/*
+ * Finds the number of differences d, leaving in *trace the furthest x
+ * reached on each diagonal k = x - y in each round before the last: round
+ * r's run from k = -r to r in steps of two, starting at r * (r + 1) / 2.
+ * Returns -1 past MAXD, and -2 (with the error set) on failure.
+ */
+static long myers(struct lines *a, struct lines *b, long **trace)
+{
+	long n = a->n, m = b->n, d, k, x, y, used = 0, alloc = 0;
+	long *v, *t = NULL, *tmp;
+	if (!(v = malloc((2 * MAXD + 3) * sizeof(*v)))) {
+		seterr("memory");
+		return -2;
+	}
+	v += MAXD + 1;
+	v[1] = 0;
+	for (d = 0; d <= MAXD; d++) {
+		for (k = -d; k <= d; k += 2) {
+			if (k == -d || (k != d && v[k - 1] < v[k + 1]))
+				x = v[k + 1];
+			else
+				x = v[k - 1] + 1;
+			y = x - k;
+			while (x < n && y < m && same(a, x, b, y))
+				x++, y++;
+			v[k] = x;
+			if (x >= n && y >= m)
+				goto found;
+		}
+		if (used + d + 1 > alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			if (!(tmp = realloc(t, alloc * sizeof(*t)))) {
+				free(t);
+				free(v - MAXD - 1);
+				seterr("memory");
+				return -2;
+			}
+			t = tmp;
+		}
+		for (k = -d; k <= d; k += 2)
+			t[used++] = v[k];
+	}
+	d = -1;
+found:
+	free(v - MAXD - 1);
+	*trace = t;
+	return d;
+}
+
+/*
+ * Walks back from the end to the start through the rounds in `trace`,
+ * collecting the hunks in reverse, as line numbers.
+ */
+static int backtrack(struct lines *a, struct lines *b, long d, long *trace,
+                     struct hunk **h, size_t *n)
+{
+	long x = a->n, y = b->n, k, pk, px, mx, sa = 0, sb = 0, ea = 0, eb = 0;
+	long *pv;
+	size_t alloc = 0;
+	int open = 0;
+	for (; d > 0; d--) {
+		/* Where each diagonal got to in the round before. */
+		pv = trace + (d - 1) * d / 2;
+		k = x - y;
+		if (k == -d || (k != d && pv[(k - 1 + d - 1) / 2] <
+		                          pv[(k + 1 + d - 1) / 2]))
+			pk = k + 1;
+		else
+			pk = k - 1;
+		px = pv[(pk + d - 1) / 2];
+		/* Going down inserts a line of b, across deletes one of a;
+		 * then the snake runs from (mx, mx - k) to (x, y). */
+		mx = pk == k + 1 ? px : px + 1;
+		if (x > mx && open) {
+			if (addhunk(h, n, &alloc, sa, ea - sa, sb, eb - sb) < 0)
+				return -1;
+			open = 0;
+		}
+		if (!open) {
+			ea = mx;
+			eb = mx - k;
+			open = 1;
+		}
+		sa = x = px;
+		sb = y = px - pk;
+	}
+	if (open && addhunk(h, n, &alloc, sa, ea - sa, sb, eb - sb) < 0)
+		return -1;
+	return 0;
+}
+
+long linediff(char *a, size_t asz, char *b, size_t bsz, struct hunk **hunks)
+{
+	struct lines la, lb;
+	struct hunk *h = NULL, t;
+	size_t p, s, n = 0, i;
+	long d, *trace = NULL;
+	char *q;
+	*hunks = NULL;
+	/* Trim to whole lines in common at the start, and at the end. */
+	p = prefix(a, b, asz < bsz ? asz : bsz);
+	while (p > 0 && a[p - 1] != '\n')
+		p--;
+	s = suffix(a + asz, b + bsz, (asz < bsz ? asz : bsz) - p);
+	if ((asz - s > p && a[asz - s - 1] != '\n') ||
+	    (bsz - s > p && b[bsz - s - 1] != '\n')) {
+		q = memchr(a + asz - s, '\n', s);
+		s = q ? (size_t)(a + asz - q - 1) : 0;
+	}
+	asz -= s + p;
+	bsz -= s + p;
+	if (!asz && !bsz)
+		return 0;
+	if (!asz || !bsz)
+		goto whole;
+	if (split(&la, a + p, asz) < 0)
+		return -1;
+	if (split(&lb, b + p, bsz) < 0) {
+		free(la.off);
+		free(la.hash);
+		return -1;
+	}
+	d = myers(&la, &lb, &trace);
+	if (d >= 0 && backtrack(&la, &lb, d, trace, &h, &n) < 0)
+		d = -2;
+	free(trace);
+	if (d >= 0) {
+		/* Put them in order, and turn lines into bytes. */
+		for (i = 0; i < n / 2; i++) {
+			t = h[i];
+			h[i] = h[n - 1 - i];
+			h[n - 1 - i] = t;
+		}
+		for (i = 0; i < n; i++) {
+			t = h[i];
+			h[i].a = p + la.off[t.a];
+			h[i].na = la.off[t.a + t.na] - la.off[t.a];
+			h[i].b = p + lb.off[t.b];
+			h[i].nb = lb.off[t.b + t.nb] - lb.off[t.b];
+		}
+	}
+	free(la.off);
+	free(la.hash);
+	free(lb.off);
+	free(lb.hash);
+	if (d == -2) {
+		free(h);
+		return -1;
+	}
+	if (d >= 0) {
+		*hunks = h;
+		return n;
+	}
+whole:
+	if (!(h = malloc(sizeof(*h)))) {
+		seterr("memory");
+		return -1;
+	}
+	h->a = h->b = p;
+	h->na = asz;
+	h->nb = bsz;
+	*hunks = h;
+	return 1;
+}
@@ -0,0 +1,23 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+/*
+ * A change between two texts: `na` bytes at offset `a` of the old one
+ * became `nb` bytes at offset `b` of the new one.
+ */
+struct hunk {
+	size_t a, na;
+	size_t b, nb;
+};
+
+/*
+ * Finds the lines that differ between the old text [a, a + asz) and the
+ * new one [b, b + bsz), and stores them in *hunks as a malloc'd array in
+ * order, the text between them being the same in both.  The diff is the
+ * shortest there is unless the texts differ in more than a few thousand
+ * lines, when what lies between the first and last difference becomes a
+ * single hunk.  Returns how many hunks there are (with *hunks NULL if
+ * none), or -1 (with the error set) on failure.
+ */
+long linediff(char *a, size_t asz, char *b, size_t bsz, struct hunk **hunks);
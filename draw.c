@@ -3,60 +3,118 @@
 #include <assert.h>
 #include <ctype.h>
 #include <curses.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "draw.h"
 #include "buffer.h"
+#include "err.h"
+#include "stream.h"
+#include "trace.h"
+#include "utf8.h"
 #include "yank.h"
 
 #define MODELINE 1
 #define WHITESPACE 2
 #define TARGET 3
 
-int show_whitespace;
+/* How many rows apart backrows marks where rows start in a line. */
+#define MARKROWS 256
 
-static char *scroll_ptr;
-static int scroll_linum;
+int show_whitespace;
 
+/*
+ * The window is laid out in screen rows.  A row ends after a newline or
+ * once it's COLS wide, and the window can start at any row, even in the
+ * middle of a line.  Layout only ever looks at the rows it needs, so a
+ * frame costs the same however long the lines are.  Scrolling back keeps
+ * marks in the line it's in (see struct scroll) for the same reason.
+ */
 struct {
 	char *start;
 	char *end;
+	int rows;	/* rows of text in the window */
 } bounds;
 
-static void pc(char c);
+static char *pc(char *p);
+static char *plainrun(char *p, char *end);
 static void ptarg(int count);
 static char *nextline(char *p);
-static void advcursor(char c);
+static char *linestart(char *p);
+static char *nextrow(char *p);
+static void newlayout(struct scroll *s, char *ls);
+static void addmark(struct scroll *s, size_t off);
+static char *lineof(struct scroll *s, char *p);
+static size_t rowsbefore(struct scroll *s, char *p);
+static char *rowstart(struct scroll *s, size_t row);
+static char *backrows(char *p, int n, int *line);
+static int colsfor(char *p, int column, int *len);
+static char *advcursor(char *p);
 
 void present(void)
 {
+	TRACE_ENTER(TRACE_REFRESH);
 	refresh();
+	TRACE_LEAVE();
+	TRACE_FRAME();
 }
 
 void clrscreen(void)
 {
+	TRACE_ENTER(TRACE_DRAW);
 	erase();
+	TRACE_LEAVE();
 }
 
 int scroll_line()
 {
-	return scroll_linum;
+	return bufscroll()->line;
 }
 
 void set_scroll(int n)
 {
-	scroll_linum = n;
-	if (scroll_linum < 0)
-		scroll_linum = 0;
-	scroll_ptr = getbufstart();
-	for (int i = 0; scroll_ptr != getbufend() && i < scroll_linum; i++)
-		scroll_ptr = nextline(scroll_ptr);
+	struct scroll *s = bufscroll();
+	char *p = getbufstart();
+	TRACE_ENTER(TRACE_LAYOUT);
+	s->line = n < 0 ? 0 : n;
+	for (int i = 0; p != getbufend() && i < s->line; i++)
+		p = nextline(p);
+	s->off = p - getbufstart();
 	refresh_bounds();
+	TRACE_LEAVE();
 }
 
 void adjust_scroll(int delta)
 {
-	set_scroll(scroll_line() + delta);
+	struct scroll *s = bufscroll();
+	char *p = getbufstart() + s->off;
+	TRACE_ENTER(TRACE_LAYOUT);
+	for (; delta > 0 && p != getbufend(); delta--) {
+		p = nextrow(p);
+		if (p[-1] == '\n')
+			s->line++;
+	}
+	if (delta < 0)
+		p = backrows(p, -delta, &s->line);
+	s->off = p - getbufstart();
+	refresh_bounds();
+	TRACE_LEAVE();
+}
+
+void scroll_to_end(void)
+{
+	struct scroll *s = bufscroll();
+	char *start = getbufstart() + s->off, *top;
+	int ignored = 0;
+	TRACE_ENTER(TRACE_LAYOUT);
+	top = backrows(getbufend(), LINES - 1, &ignored);
+	if (top > start) {
+		s->line += countwithin(start, top, '\n');
+		s->off = top - getbufstart();
+	}
+	refresh_bounds();
+	TRACE_LEAVE();
 }
 
 char *winstart()
@@ -81,47 +139,197 @@ int wincols()
 
 void refresh_bounds()
 {
-	bounds.start = scroll_ptr;
-	int r = 0;
+	struct scroll *s = bufscroll();
+	TRACE_ENTER(TRACE_LAYOUT);
+	if (s->off > (size_t)(getbufend() - getbufstart()))
+		s->off = getbufend() - getbufstart();
+	bounds.start = getbufstart() + s->off;
 	bounds.end = bounds.start;
-	while (bounds.end != getbufend() && r < LINES - 1) {
-		r += screenlines(bounds.end);
-		bounds.end = nextline(bounds.end);
-	}
+	for (bounds.rows = 0; bounds.end != getbufend() && bounds.rows < LINES - 1;
+	     bounds.rows++)
+		bounds.end = nextrow(bounds.end);
 	assert(inbuf(bounds.start) && inbuf(bounds.end));
+	TRACE_LEAVE();
 }
 
-char *skipscreenlines(char *start, int lines)
+char *winline(void)
 {
-	assert(inbuf(start));
-	while (lines > 0 && start < getbufend()) {
-		lines -= screenlines(start);
-		start = endofline(start) + 1;
-	}
-	if (start > getbufend())
-		start = getbufend();
-	return start;
+	return linestart(winstart());
 }
 
-int screenlines(char *start)
+/*
+ * Returns the columns the character at p adds at `column`, and its
+ * length in *len.  A character too wide for the rest of the row goes on
+ * the next one, as curses does, which shows as the columns skipped plus
+ * its own.  Newlines aren't handled here.
+ */
+static int colsfor(char *p, int column, int *len)
 {
-	char *end = endofline(start);
-	if (start == NULL || end == NULL)
+	int w;
+	if (*p == '\t') {
+		*len = 1;
+		return TABSIZE - column % TABSIZE;
+	}
+	if ((w = charwidth(p, getbufend(), len)) < 0)
 		return 1;
-	int len = 0;
-	for (char *i = start; i != end; i++) {
-		if (*i == '\t') {
-			int to_tab = TABSIZE - (len % TABSIZE);
-			len += to_tab;
+	if (column > 0 && column + w > COLS)
+		return COLS - column + w;
+	return w;
+}
+
+/* Returns the start of the row after the one starting at p, laying it
+ * out the same way advcursor does.  Runs of plain ASCII, which is most
+ * text, are skipped a word at a time. */
+static char *nextrow(char *p)
+{
+	char *end = getbufend();
+	int column = 0, len, w;
+	size_t n;
+	while (p < end) {
+		n = (size_t)(end - p) < (size_t)(COLS - column) ? (size_t)(end - p) :
+		    (size_t)(COLS - column);
+		n = asciispan(p, p + n);
+		p += n;
+		if ((column += n) >= COLS)
+			return p;
+		if (p == end)
+			break;
+		if (*p == '\n')
+			return p + 1;
+		w = colsfor(p, column, &len);
+		if (column > 0 && column + w > COLS && *p != '\t')
+			return p;
+		column += w;
+		p += len;
+		if (column >= COLS)
+			return p;
+	}
+	return p;
+}
+
+/* Starts laying out the line at ls afresh. */
+static void newlayout(struct scroll *s, char *ls)
+{
+	s->ls = s->last = ls - getbufstart();
+	s->lastrow = 0;
+	s->nmarks = 0;
+	s->gen = bufgen();
+	s->cols = COLS;
+	addmark(s, s->ls);
+}
+
+/* Marks a row start.  Without the memory to, later rows are found from
+ * the last mark there is, which only takes longer. */
+static void addmark(struct scroll *s, size_t off)
+{
+	size_t *m, n = s->amarks ? s->amarks * 2 : 16;
+	if (s->nmarks == s->amarks) {
+		if (!(m = realloc(s->marks, n * sizeof(*m))))
+			return;
+		s->marks = m;
+		s->amarks = n;
+	}
+	s->marks[s->nmarks++] = off;
+}
+
+/* Returns the start of p's line, which is the line laid out already
+ * unless the window has jumped to another, or the text or the width
+ * has changed since. */
+static char *lineof(struct scroll *s, char *p)
+{
+	char *st = getbufstart(), *last = st + s->last;
+	if (s->gen != bufgen() || s->cols != COLS || p < st + s->ls ||
+	    (p > last && memchr(last, '\n', p - last)))
+		newlayout(s, linestart(p));
+	return st + s->ls;
+}
+
+/* Returns how many rows of the line being laid out start before p,
+ * which is in it or just past its end, laying it out as far as p. */
+static size_t rowsbefore(struct scroll *s, char *p)
+{
+	char *st = getbufstart(), *q;
+	size_t lo = 0, hi = s->nmarks, mid, row;
+	while (st + s->last < p) {
+		q = nextrow(st + s->last);
+		if (q == getbufend() || q[-1] == '\n')
+			return s->lastrow + 1;
+		s->last = q - st;
+		if (++s->lastrow % MARKROWS == 0 &&
+		    s->nmarks == s->lastrow / MARKROWS)
+			addmark(s, s->last);
+	}
+	if (st + s->last == p)
+		return s->lastrow;
+	/* p is further back: count on from the last mark before it. */
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (st + s->marks[mid] <= p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	q = s->nmarks ? st + s->marks[lo] : st + s->ls;
+	for (row = s->nmarks ? lo * MARKROWS : 0; q < p; row++)
+		q = nextrow(q);
+	return row;
+}
+
+/* Returns the start of a row of the line being laid out, one that
+ * rowsbefore has passed. */
+static char *rowstart(struct scroll *s, size_t row)
+{
+	size_t m = row / MARKROWS, i;
+	char *q;
+	if (m >= s->nmarks)
+		m = s->nmarks ? s->nmarks - 1 : 0;
+	q = getbufstart() + (s->nmarks ? s->marks[m] : s->ls);
+	for (i = s->nmarks ? m * MARKROWS : 0; i < row; i++)
+		q = nextrow(q);
+	return q;
+}
+
+/*
+ * Returns the start of the row n rows above the row starting at p (or
+ * the start of the buffer), taking one off *line for each newline it
+ * crosses.  Where rows start in a line depends on the tabs and wide
+ * characters before them, so the line is laid out from its start, but
+ * only the first time: going back again finds the rows from the marks,
+ * and costs no more in a long line than in a short one.
+ */
+static char *backrows(char *p, int n, int *line)
+{
+	struct scroll *s = bufscroll();
+	char *ls;
+	size_t rows;
+	while (n > 0 && p > getbufstart()) {
+		if (p[-1] == '\n') {
+			ls = lineof(s, p - 1);
+			(*line)--;
 		} else {
-			len++;
+			ls = lineof(s, p);
 		}
+		rows = rowsbefore(s, p);
+		if ((size_t)n <= rows)
+			return rowstart(s, rows - n);
+		n -= rows;
+		p = ls;
 	}
-	return (len / COLS) + 1;
+	return p;
 }
 
-static void pc(char c)
+/* Draws the character at p and returns the one after it. */
+static char *pc(char *p)
 {
+	char c = *p;
+	int len = 1;
+	if ((unsigned char)c >= 0x80) {
+		if (charwidth(p, getbufend(), &len) < 0)
+			addch('?');
+		else
+			addnstr(p, len);
+		return p + len;
+	}
 	if (c == '\r')
 		c = '?';
 	else if (!isgraph(c) && !isspace(c))
@@ -136,38 +344,131 @@ static void pc(char c)
 		addch('\n');
 		attroff(COLOR_PAIR(WHITESPACE));
 	} else if (show_whitespace && c == '\t') {
+		int row, column;
+		getyx(stdscr, row, column);
+		(void)row;
 		attron(COLOR_PAIR(WHITESPACE));
-		for (int i = 0; i < TABSIZE; i++)
-			addch('-');
+		do addch('-'); while (++column % TABSIZE != 0 && column < COLS);
 		attroff(COLOR_PAIR(WHITESPACE));
 	} else {
 		addch(c);
 	}
+	return p + len;
 }
 
 void drawmodeline(char *filename, char *mode)
 {
 	int r = LINES - 1;
 	char buf[8192];
-	attron(COLOR_PAIR(1));
+	size_t loaded;
+	TRACE_ENTER(TRACE_DRAW);
+	attron(COLOR_PAIR(MODELINE));
 	snprintf(buf, sizeof(buf), "[F: %-32.32s][M: %-24s][L: %8d]",
 			filename, mode, scroll_line());
 	mvaddstr(r, 0, buf);
+	if (streamloading(bufcurrent(), &loaded)) {
+		snprintf(buf, sizeof(buf), "[loaded %zu]", loaded);
+		addstr(buf);
+	} else if (streamfollowing(bufcurrent())) {
+		addstr("[following]");
+	}
 	attroff(COLOR_PAIR(MODELINE));
+	TRACE_LEAVE();
 }
 
+/* Returns the end of the run at p that draws as itself, without an
+ * attribute: printable ASCII and UTF-8, less spaces if they're shown. */
+static char *plainrun(char *p, char *end)
+{
+	int len;
+	for (;;) {
+		char *s = p + asciispan(p, end);
+		if (show_whitespace && memchr(p, ' ', s - p))
+			return memchr(p, ' ', s - p);
+		p = s;
+		if (p == end || (unsigned char)*p < 0x80 ||
+		    charwidth(p, end, &len) < 0)
+			return p;
+		p += len;
+	}
+}
+
+/*
+ * Draws the window a row at a time.  A row of plain ASCII is handed to
+ * curses in one addchnstr, which copies cells without interpreting
+ * them.  Other rows go a run at a time: plain text through addnstr, and
+ * only whitespace and characters shown as '?' one by one.
+ */
 void drawtext()
 {
-	char *i;
-	erase();
-	move(0, 0);
-	for (i = winstart(); i < winend(); i++)
-		pc(*i);
+	chtype cells[COLS];
+	char *i, *e, *row, *next;
+	int r, n;
+	TRACE_ENTER(TRACE_DRAW);
+	/* The callers have already cleared the screen. */
+	for (r = 0, row = winstart(); row < winend(); r++, row = next) {
+		next = nextrow(row);
+		e = next > row && next[-1] == '\n' ? next - 1 : next;
+		n = e - row;
+		if (plainrun(row, e) == e && asciispan(row, e) == (size_t)n) {
+			for (int j = 0; j < n; j++)
+				cells[j] = (unsigned char)row[j];
+			mvaddchnstr(r, 0, cells, n);
+			if (e != next && show_whitespace && n < COLS) {
+				attron(COLOR_PAIR(WHITESPACE));
+				mvaddch(r, n, '$');
+				attroff(COLOR_PAIR(WHITESPACE));
+			}
+			continue;
+		}
+		move(r, 0);
+		for (i = row; i < next;) {
+			if ((e = plainrun(i, next)) > i) {
+				addnstr(i, e - i);
+				i = e;
+			} else if (show_whitespace && *i == ' ') {
+				attron(COLOR_PAIR(WHITESPACE));
+				for (; i < next && *i == ' '; i++)
+					addch('.');
+				attroff(COLOR_PAIR(WHITESPACE));
+			} else {
+				i = pc(i);
+			}
+		}
+	}
+	TRACE_LEAVE();
 }
 
-void initcurses()
+int initcurses(int headless)
 {
-	initscr();
+	FILE *tty = NULL;
+	/* If standard input is the file being read, take keys from the
+	 * terminal directly. */
+	if (!headless && !isatty(STDIN_FILENO))
+		tty = fopen("/dev/tty", "r");
+	if (!headless && !tty) {
+		initscr();
+	} else if (!headless) {
+		if (!newterm(getenv("TERM"), stdout, tty)) {
+			seterr("can't start curses");
+			return -1;
+		}
+	} else {
+		/* Render as usual, but into /dev/null, so the work a frame
+		 * takes is still there to be measured. */
+		char *term = getenv("TERM");
+		FILE *out = fopen("/dev/null", "w");
+		FILE *in = fopen("/dev/null", "r");
+		if (!out || !in) {
+			seterr("can't start curses");
+			return -1;
+		}
+		if ((!term || !newterm(term, out, in)) &&
+		    !newterm("vt100", out, in)) {
+			seterr("can't start curses");
+			return -1;
+		}
+	}
 	cbreak();
 	noecho();
 	nonl();
@@ -182,39 +483,53 @@ void initcurses()
 	init_pair(MODELINE, COLOR_CYAN, COLOR_BLACK);
 	init_pair(WHITESPACE, COLOR_BLUE, COLOR_BLACK);
 	init_pair(TARGET, COLOR_BLACK, COLOR_GREEN);
+	return 0;
 }
 
-static void advcursor(char c)
+/* Moves the cursor past the character at p and returns the one after
+ * it. */
+static char *advcursor(char *p)
 {
-	int row, column;
+	int row, column, len = 1, w;
 	getyx(stdscr, row, column);
-	if (c == '\n') {
+	if (*p == '\n') {
 		row++;
 		column = 0;
-	} else if (c == '\t') {
-		do column++; while(column % TABSIZE != 0);
 	} else {
-		column++;
+		w = colsfor(p, column, &len);
+		if (*p != '\t' && column > 0 && column + w > COLS) {
+			/* It didn't fit, so it starts the next row. */
+			w -= COLS - column;
+			row++;
+			column = 0;
+		}
+		column += w;
 	}
 	if (column >= COLS) {
 		row++;
 		column = 0;
 	}
 	move(row, column);
+	return p + len;
 }
 
 void drawdisamb(char c, int lvl, int toskip)
 {
+	TRACE_ENTER(TRACE_DRAW);
 	move(0, 0);
 	int tcount = 0;
-	for (char *i = winstart(); i < winend(); i++) {
-		if (*i == c && toskip <= 0)
+	for (char *i = winstart(); i < winend();) {
+		int hit = *i == c;
+		if (hit && toskip <= 0) {
 			ptarg(tcount++);
-		else
-			advcursor(*i);
-		if (*i == c)
+			i++;
+		} else {
+			i = advcursor(i);
+		}
+		if (hit)
 			toskip = (toskip > 0) ? (toskip - 1) : skips(lvl);
 	}
+	TRACE_LEAVE();
 }
 
 static void ptarg(int count)
@@ -222,7 +537,7 @@ static void ptarg(int count)
 	char a;
 	a = 'a' + (count % 26);
 	attron(COLOR_PAIR(TARGET));
-	pc(a);
+	addch(a);
 	attroff(COLOR_PAIR(TARGET));
 }
 
@@ -231,17 +546,32 @@ void drawlinelbls(int lvl, int off)
 	int count = 0;
 	char *p = winstart();
 	int toskip = off;
-	for (int line = 0; line < LINES - 1;) {
-		if (toskip == 0) {
-			move(line, 0);
-			ptarg(count++);
-			toskip = skips(lvl);
-		} else {
-			toskip--;
+	TRACE_ENTER(TRACE_DRAW);
+	/* Every row that starts a line gets a label, as does the first row
+	 * and each row past the end of the buffer. */
+	for (int row = 0; row < LINES - 1; row++) {
+		if (row == 0 || p == getbufend() || p[-1] == '\n') {
+			if (toskip == 0) {
+				move(row, 0);
+				ptarg(count++);
+				toskip = skips(lvl);
+			} else {
+				toskip--;
+			}
 		}
-		line += screenlines(p);
-		p = nextline(p);
+		if (p != getbufend())
+			p = nextrow(p);
 	}
+	TRACE_LEAVE();
+}
+
+/* Returns the start of the line holding p. */
+static char *linestart(char *p)
+{
+	char *start = getbufstart();
+	while (p > start && p[-1] != '\n')
+		p--;
+	return p;
 }
 
 static char *nextline(char *p)
@@ -294,36 +624,38 @@ int count(char c)
 void drawlineoverlay(void)
 {
 	int lineno = scroll_line() + 1;
-	int screenline = 0;
-	int fileline = 0;
+	char *p = winstart();
+	TRACE_ENTER(TRACE_DRAW);
 	attron(COLOR_PAIR(TARGET));
-	while (screenline < LINES) {
-		char nstr[32];
-		snprintf(nstr, sizeof(nstr), "%4d", lineno);
-		mvaddstr(screenline, 0, nstr);
-		char *lstart = skipscreenlines(winstart(), fileline);
-		if (lstart == NULL)
-			break;
-		screenline += screenlines(lstart);
-		fileline++;
-		lineno++;
+	for (int row = 0; row < LINES - 1; row++) {
+		if (row == 0 || p == getbufend() || p[-1] == '\n') {
+			char nstr[32];
+			snprintf(nstr, sizeof(nstr), "%4d", lineno++);
+			mvaddstr(row, 0, nstr);
+		}
+		if (p != getbufend())
+			p = nextrow(p);
 	}
 	attroff(COLOR_PAIR(TARGET));
+	TRACE_LEAVE();
 }
 
 void drawmessage(char *msg)
 {
+	TRACE_ENTER(TRACE_DRAW);
 	assert(msg != NULL);
 	attron(COLOR_PAIR(MODELINE));
 	mvaddstr(LINES - 1, 0, msg);
 	attroff(COLOR_PAIR(MODELINE));
+	TRACE_LEAVE();
 }
 
 void drawyanks()
 {
-	char *ytext;
-	unsigned lines, nyanks, linestodraw, ysz, previewsz, i, j;
+	char ytext[COLS];
+	unsigned lines, nyanks, linestodraw, previewsz, i, j;
 	char c;
+	TRACE_ENTER(TRACE_DRAW);
 	nyanks = yank_sz();
 	lines = LINES;
 	linestodraw = nyanks < lines ? nyanks : lines;
@@ -331,36 +663,45 @@ void drawyanks()
 		attron(COLOR_PAIR(TARGET));
 		mvaddch(i, 0, 'a' + i);
 		attroff(COLOR_PAIR(TARGET));
-		yank_item(&ytext, &ysz, i);
-		previewsz = COLS - 2;
-		if (ysz < previewsz)
-			previewsz = ysz;
+		previewsz = yank_preview(ytext, COLS - 2, i);
 		for (j = 0; j < previewsz; j++) {
 			c = ytext[j];
 			c = (isgraph(c) || c == ' ') ? c : '?';
 			addch(c);
 		}
 	}
+	TRACE_LEAVE();
 }
 
-void draw_eof(void)
+void drawbuffers(char **names, int n, int cur)
 {
-	char *start = skipscreenlines(getbufstart(), scroll_line());
-	int r = 0;
-	while(start != getbufend() && r < LINES - 1) {
-		r += screenlines(start);
-		start = skipscreenlines(start,1);
+	int i;
+	TRACE_ENTER(TRACE_DRAW);
+	for (i = 0; i < n && i < LINES; i++) {
+		attron(COLOR_PAIR(TARGET));
+		mvaddch(i, 0, 'a' + i);
+		attroff(COLOR_PAIR(TARGET));
+		addstr(i == cur ? " * " : "   ");
+		addstr(names[i]);
 	}
+	TRACE_LEAVE();
+}
 
-	for(; r < LINES - 1; ++r)
-		mvaddch(r,0,'~');
+void draw_eof(void)
+{
+	TRACE_ENTER(TRACE_DRAW);
+	for (int r = bounds.rows; r < LINES - 1; ++r)
+		mvaddch(r, 0, '~');
 	move(0,0);
+	TRACE_LEAVE();
 }
 
 void movecursor(char *p)
 {
+	TRACE_ENTER(TRACE_DRAW);
 	assert(inbuf(p));
 	move(0, 0);
-	for (char *i = winstart(); i < winend() && i < p; i++)
-		advcursor(*i);
+	for (char *i = winstart(); i < winend() && i < p;)
+		i = advcursor(i);
+	TRACE_LEAVE();
 }
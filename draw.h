@@ -1,14 +1,19 @@
 /* (C) 2015 Tom Wright. */
 
-int show_whitespace;
+extern int show_whitespace;
 
-void initcurses(void);
+/* Starts curses on the terminal, or with headless set, without one.
+ * Returns 0 on success and -1 on failure. */
+int initcurses(int headless);
 void clrscreen(void);
 void present(void);
 
 int scroll_line(void);
 void set_scroll(int n);
+/* Scrolls by delta screen rows. */
 void adjust_scroll(int delta);
+/* Scrolls forward just far enough to show the end of the buffer. */
+void scroll_to_end(void);
 
 /* Get window boundaries */
 char *winstart(void);
@@ -17,8 +22,8 @@ char *winend(void);
 int winrows(void);
 int wincols(void);
 
-int screenlines(char *start);
-char *skipscreenlines(char *start, int lines);
+/* The start of the line that the window starts in. */
+char *winline(void);
 
 void drawmodeline(char *filename, char *mode);
 void drawtext(void);
@@ -27,6 +32,8 @@ void drawlinelbls(int lvl, int off);
 void drawlineoverlay(void);
 void drawmessage(char *msg);
 void drawyanks(void);
+/* Lists the open files with a letter for each, marking the current one. */
+void drawbuffers(char **names, int n, int cur);
 void draw_eof(void);
 
 int skips(int lvl);
@@ -0,0 +1,462 @@
+/* (C) 2015 Tom Wright */
+
+#include <locale.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bang.h"
+#include "err.h"
+#include "filter.h"
+
+#define MAXARGS 8
+/* A sort is only shared out when each thread gets at least this many
+ * lines. */
+#define PARLINES 65536
+#define MAXTHREADS 16
+#define MAXINDENT 256
+
+/* A line, without its newline.  Sorting by bytes, key holds its first
+ * eight, big-endian and padded with nuls, which orders most lines without
+ * going to them. */
+struct line {
+	char *p;
+	size_t n;
+	uint64_t key;
+};
+
+/* Lines for a thread to sort, or two sorted runs for it to merge. */
+struct run {
+	struct line *a, *b, *out;
+	size_t na, nb;
+};
+
+/* How lines are compared, set before each sort. */
+static int sortrev, sortuniq, sortcoll;
+
+static int split(char *cmd, char **args);
+static int getlines(char *p, size_t sz, struct line **lines, size_t *n);
+static int newoutput(struct bang_output *out, size_t sz);
+static void putline(struct bang_output *out, struct line *l, int nl);
+static void setkey(struct line *l);
+static int cmpbytes(const struct line *a, const struct line *b);
+static int cmpkey(const struct line *a, const struct line *b);
+static int cmpline(const struct line *a, const struct line *b);
+static void merge(struct line *a, size_t na, struct line *b, size_t nb,
+                  struct line *out);
+static void msort(struct line *l, size_t n, struct line *tmp);
+static void *sortrun(void *arg);
+static void *mergerun(void *arg);
+static int parsort(struct line *l, size_t n);
+static int sortlines(struct bang_output *out, char *in, size_t sz, int rev,
+                     int uniq);
+static int uniqlines(struct bang_output *out, char *in, size_t sz);
+static int taclines(struct bang_output *out, char *in, size_t sz);
+static int indentlines(struct bang_output *out, char *in, size_t sz,
+                       long n);
+static int trimlines(struct bang_output *out, char *in, size_t sz);
+
+/* Splits cmd into words at blanks.  Returns how many, or -1 if there are
+ * more than MAXARGS - 1.  cmd is changed. */
+static int split(char *cmd, char **args)
+{
+	int n = 0;
+	char *p = cmd;
+	for (;;) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+			break;
+		if (n == MAXARGS - 1)
+			return -1;
+		args[n++] = p;
+		while (*p && *p != ' ' && *p != '\t')
+			p++;
+		if (*p)
+			*p++ = '\0';
+	}
+	args[n] = NULL;
+	return n;
+}
+
+/* Finds the lines of [p, p + sz); the last needn't end in a newline. */
+static int getlines(char *p, size_t sz, struct line **lines, size_t *n)
+{
+	char *end = p + sz, *e;
+	size_t count = 0;
+	for (e = p; (e = memchr(e, '\n', end - e)); e++)
+		count++;
+	if (sz && end[-1] != '\n')
+		count++;
+	if (!(*lines = malloc((count ? count : 1) * sizeof(**lines)))) {
+		seterr("memory");
+		return -1;
+	}
+	for (*n = 0; p < end; p = e + 1) {
+		if (!(e = memchr(p, '\n', end - p)))
+			e = end;
+		(*lines)[*n].p = p;
+		(*lines)[(*n)++].n = e - p;
+	}
+	return 0;
+}
+
+/* Starts an output with room for sz bytes and a nul. */
+static int newoutput(struct bang_output *out, size_t sz)
+{
+	if (!(out->buf = malloc(sz + 1))) {
+		seterr("memory");
+		return -1;
+	}
+	out->sz = 0;
+	out->buf[0] = '\0';
+	return 0;
+}
+
+static void putline(struct bang_output *out, struct line *l, int nl)
+{
+	memcpy(out->buf + out->sz, l->p, l->n);
+	out->sz += l->n;
+	if (nl)
+		out->buf[out->sz++] = '\n';
+	out->buf[out->sz] = '\0';
+}
+
+static void setkey(struct line *l)
+{
+	size_t i;
+	l->key = 0;
+	for (i = 0; i < 8; i++)
+		l->key = l->key << 8 | (i < l->n ? (unsigned char)l->p[i] : 0);
+}
+
+static int cmpbytes(const struct line *a, const struct line *b)
+{
+	int r = memcmp(a->p, b->p, a->n < b->n ? a->n : b->n);
+	if (r)
+		return r;
+	return (a->n > b->n) - (a->n < b->n);
+}
+
+/*
+ * Compares lines as sort does: by strcoll outside the C locale, falling
+ * back on the bytes when that finds them equal, except that with -u
+ * lines that collate the same are the same.
+ */
+static int cmpkey(const struct line *a, const struct line *b)
+{
+	int r = 0;
+	if (sortcoll)
+		r = strcoll(a->p, b->p);
+	else if (a->key != b->key)
+		r = a->key < b->key ? -1 : 1;
+	if (!r && (!sortcoll || !sortuniq))
+		r = cmpbytes(a, b);
+	return sortrev ? -r : r;
+}
+
+/* Lines that compare the same stay in their order, so -u keeps the
+ * first of them. */
+static int cmpline(const struct line *a, const struct line *b)
+{
+	int r = cmpkey(a, b);
+	if (r)
+		return r;
+	return (a->p > b->p) - (a->p < b->p);
+}
+
+static void merge(struct line *a, size_t na, struct line *b, size_t nb,
+                  struct line *out)
+{
+	struct line *ae = a + na, *be = b + nb;
+	while (a < ae && b < be)
+		*out++ = cmpline(a, b) <= 0 ? *a++ : *b++;
+	memcpy(out, a, (ae - a) * sizeof(*a));
+	out += ae - a;
+	memcpy(out, b, (be - b) * sizeof(*b));
+}
+
+/*
+ * Sorts n lines with room for n more in tmp.  A merge sort rather than
+ * qsort, so that the comparison isn't a call through a pointer; short
+ * runs are sorted by insertion.
+ */
+static void msort(struct line *l, size_t n, struct line *tmp)
+{
+	struct line t;
+	size_t i, j, h = n / 2;
+	if (n <= 8) {
+		for (i = 1; i < n; i++) {
+			t = l[i];
+			for (j = i; j > 0 && cmpline(&t, &l[j - 1]) < 0; j--)
+				l[j] = l[j - 1];
+			l[j] = t;
+		}
+		return;
+	}
+	msort(l, h, tmp);
+	msort(l + h, n - h, tmp);
+	if (cmpline(&l[h - 1], &l[h]) <= 0)
+		return;
+	memcpy(tmp, l, h * sizeof(*l));
+	merge(tmp, h, l + h, n - h, l);
+}
+
+static void *sortrun(void *arg)
+{
+	struct run *r = arg;
+	msort(r->a, r->na, r->out);
+	return NULL;
+}
+
+static void *mergerun(void *arg)
+{
+	struct run *r = arg;
+	merge(r->a, r->na, r->b, r->nb, r->out);
+	return NULL;
+}
+
+/*
+ * Sorts n lines, splitting them between up to a thread per processor:
+ * each sorts a run, then pairs of runs are merged, in parallel, until
+ * there's one.  A thread that can't be started is done inline.  Returns
+ * -1 if there's no memory to sort in.
+ */
+static int parsort(struct line *l, size_t n)
+{
+	struct run runs[MAXTHREADS], m[MAXTHREADS];
+	pthread_t th[MAXTHREADS];
+	int started[MAXTHREADS];
+	struct line *src = l, *dst, *tmp;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t t = n / PARLINES, i, k, per;
+	if ((long)t > cpus)
+		t = cpus;
+	if (t > MAXTHREADS)
+		t = MAXTHREADS;
+	if (t < 1)
+		t = 1;
+	if (!(tmp = malloc((n ? n : 1) * sizeof(*l)))) {
+		seterr("memory");
+		return -1;
+	}
+	per = n / t;
+	for (i = 0; i < t; i++) {
+		runs[i].a = l + i * per;
+		runs[i].na = i == t - 1 ? n - i * per : per;
+		runs[i].out = tmp + i * per;
+		started[i] = t > 1 &&
+		             !pthread_create(&th[i], NULL, sortrun, &runs[i]);
+		if (!started[i])
+			sortrun(&runs[i]);
+	}
+	for (i = 0; i < t; i++)
+		if (started[i])
+			pthread_join(th[i], NULL);
+	for (dst = tmp; t > 1; t = k) {
+		for (i = 0, k = 0; i + 1 < t; i += 2, k++) {
+			m[k] = runs[i];
+			m[k].b = runs[i + 1].a;
+			m[k].nb = runs[i + 1].na;
+			m[k].out = dst + (runs[i].a - src);
+			started[k] = !pthread_create(&th[k], NULL, mergerun,
+			                             &m[k]);
+			if (!started[k])
+				mergerun(&m[k]);
+		}
+		for (i = 0; i < k; i++) {
+			if (started[i])
+				pthread_join(th[i], NULL);
+			runs[i].a = m[i].out;
+			runs[i].na = m[i].na + m[i].nb;
+		}
+		if (t % 2) {
+			runs[k].a = dst + (runs[t - 1].a - src);
+			memcpy(runs[k].a, runs[t - 1].a,
+			       runs[t - 1].na * sizeof(*l));
+			runs[k].na = runs[t - 1].na;
+			k++;
+		}
+		src = dst;
+		dst = src == tmp ? l : tmp;
+	}
+	if (src != l)
+		memcpy(l, src, n * sizeof(*l));
+	free(tmp);
+	return 0;
+}
+
+static int sortlines(struct bang_output *out, char *in, size_t sz, int rev,
+                     int uniq)
+{
+	struct line *l;
+	char *coll, *copy = NULL;
+	size_t n, i, last;
+	coll = setlocale(LC_COLLATE, NULL);
+	sortcoll = coll && strcmp(coll, "C") && strcmp(coll, "POSIX");
+	sortrev = rev;
+	sortuniq = uniq;
+	/* strcoll wants strings, so the lines are sorted from a copy with
+	 * nuls for newlines; a nul already in one is left to sort. */
+	if (sortcoll && memchr(in, '\0', sz))
+		return 0;
+	if (getlines(in, sz, &l, &n) < 0)
+		return -1;
+	if (sortcoll) {
+		if (!(copy = malloc(sz + 1))) {
+			free(l);
+			seterr("memory");
+			return -1;
+		}
+		memcpy(copy, in, sz);
+		for (i = 0; i < sz; i++)
+			if (copy[i] == '\n')
+				copy[i] = '\0';
+		copy[sz] = '\0';
+		for (i = 0; i < n; i++)
+			l[i].p = copy + (l[i].p - in);
+	} else {
+		for (i = 0; i < n; i++)
+			setkey(&l[i]);
+	}
+	if (parsort(l, n) < 0 || newoutput(out, sz + 1) < 0) {
+		free(l);
+		free(copy);
+		return -1;
+	}
+	for (i = 0, last = 0; i < n; i++) {
+		if (uniq && i > 0 && cmpkey(&l[last], &l[i]) == 0)
+			continue;
+		putline(out, &l[i], 1);
+		last = i;
+	}
+	free(l);
+	free(copy);
+	return 1;
+}
+
+static int uniqlines(struct bang_output *out, char *in, size_t sz)
+{
+	struct line *l;
+	size_t n, i;
+	if (getlines(in, sz, &l, &n) < 0)
+		return -1;
+	if (newoutput(out, sz + 1) < 0) {
+		free(l);
+		return -1;
+	}
+	for (i = 0; i < n; i++)
+		if (i == 0 || cmpbytes(&l[i - 1], &l[i]))
+			putline(out, &l[i], 1);
+	free(l);
+	return 1;
+}
+
+/* Like tac, a last line without a newline runs into the one before. */
+static int taclines(struct bang_output *out, char *in, size_t sz)
+{
+	struct line *l;
+	size_t n, i;
+	if (getlines(in, sz, &l, &n) < 0)
+		return -1;
+	if (newoutput(out, sz) < 0) {
+		free(l);
+		return -1;
+	}
+	for (i = n; i-- > 0;)
+		putline(out, &l[i], l[i].p + l[i].n < in + sz);
+	free(l);
+	return 1;
+}
+
+static int indentlines(struct bang_output *out, char *in, size_t sz,
+                       long n)
+{
+	struct line *l, t;
+	size_t nl, i;
+	long k;
+	if (getlines(in, sz, &l, &nl) < 0)
+		return -1;
+	if (newoutput(out, sz + nl * (n > 0 ? n : 1)) < 0) {
+		free(l);
+		return -1;
+	}
+	for (i = 0; i < nl; i++) {
+		t = l[i];
+		if (n == 0 && t.n)
+			out->buf[out->sz++] = '\t';
+		for (k = 0; k < n && t.n; k++)
+			out->buf[out->sz++] = ' ';
+		for (k = 0; k < -n && t.n && (*t.p == ' ' || *t.p == '\t'); k++)
+			t.p++, t.n--;
+		putline(out, &t, t.p + t.n < in + sz);
+	}
+	free(l);
+	return 1;
+}
+
+static int trimlines(struct bang_output *out, char *in, size_t sz)
+{
+	struct line *l, t;
+	size_t n, i;
+	if (getlines(in, sz, &l, &n) < 0)
+		return -1;
+	if (newoutput(out, sz) < 0) {
+		free(l);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		t = l[i];
+		while (t.n && (t.p[t.n - 1] == ' ' || t.p[t.n - 1] == '\t'))
+			t.n--;
+		putline(out, &t, l[i].p + l[i].n < in + sz);
+	}
+	free(l);
+	return 1;
+}
+
+int runfilter(struct bang_output *out, char *cmd, char *input, int input_sz)
+{
+	char buf[256], *args[MAXARGS], *end, *o;
+	int n, rev = 0, uniq = 0;
+	long indent;
+	if (strlen(cmd) >= sizeof(buf))
+		return 0;
+	strcpy(buf, cmd);
+	if ((n = split(buf, args)) < 1)
+		return 0;
+	if (!strcmp(args[0], "sort")) {
+		for (n = 1; args[n]; n++) {
+			if (args[n][0] != '-' || !args[n][1])
+				return 0;
+			for (o = args[n] + 1; *o; o++) {
+				if (*o == 'r')
+					rev = 1;
+				else if (*o == 'u')
+					uniq = 1;
+				else
+					return 0;
+			}
+		}
+		return sortlines(out, input, input_sz, rev, uniq);
+	}
+	if (!strcmp(args[0], "uniq") && n == 1)
+		return uniqlines(out, input, input_sz);
+	if (!strcmp(args[0], "tac") && n == 1)
+		return taclines(out, input, input_sz);
+	if (!strcmp(args[0], ":trim") && n == 1)
+		return trimlines(out, input, input_sz);
+	if (!strcmp(args[0], ":indent") && n <= 2) {
+		indent = 0;
+		if (n == 2) {
+			indent = strtol(args[1], &end, 10);
+			if (*end || indent == 0 || indent > MAXINDENT ||
+			    indent < -MAXINDENT)
+				return 0;
+		}
+		return indentlines(out, input, input_sz, indent);
+	}
+	return 0;
+}
@@ -0,0 +1,29 @@
+/* (C) 2015 Tom Wright */
+
+struct bang_output;
+
+/*
+ * Filters that `!` runs in the editor, without starting a shell, for the
+ * commands it's given most.  These stand in for the programs of the same
+ * name, with the same output:
+ *
+ *	sort [-r] [-u]	sorts the lines in the locale's collating order
+ *	uniq		drops each line that repeats the one before
+ *	tac		reverses the order of the lines
+ *
+ * and these, named with a colon so they can't be taken for programs,
+ * have none to stand in for:
+ *
+ *	:indent [n]	puts a tab, or n spaces, before each line that
+ *			isn't empty; with n negative, takes up to -n
+ *			spaces or tabs off the start of each line
+ *	:trim		takes the spaces and tabs off the end of each line
+ *
+ * Any other command, or one of these with other options, goes to the
+ * shell.  Big sorts are shared out between threads.
+ */
+
+/* Runs `cmd` on the input if it's one of the above.  Returns 1 with the
+ * result in *out, 0 if it isn't one of them, and -1 (with the error
+ * set) on failure. */
+int runfilter(struct bang_output *out, char *cmd, char *input, int input_sz);
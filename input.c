@@ -0,0 +1,330 @@
+/* (C) 2015 Tom Wright */
+
+#include <curses.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "input.h"
+#include "trace.h"
+
+struct scriptkey {
+	int key;
+	int delay;	/* milliseconds to wait before delivering the key */
+	int line;	/* line of the script, for the report */
+};
+
+static const struct {
+	char *name;
+	int key;
+} keynames[] = {
+	{ "<down>", KEY_DOWN },
+	{ "<up>", KEY_UP },
+	{ "<npage>", KEY_NPAGE },
+	{ "<ppage>", KEY_PPAGE },
+	{ "<backspace>", KEY_BACKSPACE },
+	{ "<paste>", KEY_PASTE },
+	{ "</paste>", KEY_PASTEEND },
+};
+
+static struct scriptkey *script;
+static int nscript, nextkey;
+static double *latency;
+static double delivered;
+/* When the next key's delay is up, once it's been asked for. */
+static double due;
+static int waiting;
+static FILE *recf;
+static double lastrec;
+
+static double now(void);
+static int parsekey(char *s);
+static void putkey(FILE *f, int c);
+static int cmpd(const void *a, const void *b);
+static void sleepfor(double secs);
+static int replaykey(int ms);
+static int keywithin(int ms);
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Parses a key from the script syntax described in input.h.  Returns
+ * -1 if `s` isn't a key. */
+static int parsekey(char *s)
+{
+	size_t i;
+	if (s[0] == '\0')
+		return -1;
+	if (s[1] == '\0')
+		return (unsigned char)s[0];
+	if (s[0] == '\\' && s[2] == '\0') {
+		switch (s[1]) {
+		case 'e': return 27;
+		case 'r': return '\r';
+		case 'n': return '\n';
+		case 't': return '\t';
+		case 's': return ' ';
+		case '\\': return '\\';
+		}
+		return -1;
+	}
+	if (s[0] == '^' && s[2] == '\0')
+		return s[1] == '?' ? 127 : (s[1] & 0x1f);
+	if (s[0] == '#')
+		return atoi(s + 1);
+	for (i = 0; i < sizeof(keynames) / sizeof(keynames[0]); i++)
+		if (strcmp(s, keynames[i].name) == 0)
+			return keynames[i].key;
+	return -1;
+}
+
+static void putkey(FILE *f, int c)
+{
+	size_t i;
+	for (i = 0; i < sizeof(keynames) / sizeof(keynames[0]); i++) {
+		if (c == keynames[i].key) {
+			fprintf(f, "%s\n", keynames[i].name);
+			return;
+		}
+	}
+	switch (c) {
+	case 27: fputs("\\e\n", f); return;
+	case '\r': fputs("\\r\n", f); return;
+	case '\n': fputs("\\n\n", f); return;
+	case '\t': fputs("\\t\n", f); return;
+	case ' ': fputs("\\s\n", f); return;
+	case '\\': fputs("\\\\\n", f); return;
+	case 127: fputs("^?\n", f); return;
+	}
+	if (c > ' ' && c < 127)
+		fprintf(f, "%c\n", c);
+	else if (c >= 0 && c < ' ')
+		fprintf(f, "^%c\n", c + '@');
+	else
+		fprintf(f, "#%d\n", c);
+}
+
+int replayfrom(char *path)
+{
+	char line[256], *k, *nl;
+	int lineno, alloc;
+	FILE *f;
+	if (!(f = fopen(path, "r"))) {
+		seterr("can't open key script");
+		return -1;
+	}
+	alloc = 0;
+	for (lineno = 1; fgets(line, sizeof(line), f); lineno++) {
+		struct scriptkey sk = { .delay = 0, .line = lineno };
+		if ((nl = strchr(line, '\n')))
+			*nl = '\0';
+		if (line[0] == '\0' || (line[0] == '#' && line[1] == ' '))
+			continue;
+		k = line;
+		if (line[0] == '+' && line[1] >= '0' && line[1] <= '9') {
+			sk.delay = strtol(line + 1, &k, 10);
+			if (*k == ' ')
+				k++;
+		}
+		if ((sk.key = parsekey(k)) < 0) {
+			seterr("bad key in key script");
+			fclose(f);
+			return -1;
+		}
+		if (nscript == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			void *s = realloc(script, alloc * sizeof(*script));
+			void *l = realloc(latency, alloc * sizeof(*latency));
+			if (s)
+				script = s;
+			if (l)
+				latency = l;
+			if (!s || !l) {
+				seterr("memory");
+				fclose(f);
+				return -1;
+			}
+		}
+		script[nscript++] = sk;
+	}
+	fclose(f);
+	return 0;
+}
+
+int recordto(char *path)
+{
+	if (!(recf = fopen(path, "w"))) {
+		seterr("can't write key script");
+		return -1;
+	}
+	fputs("# lwe key script\n", recf);
+	return 0;
+}
+
+int replaying(void)
+{
+	return script != NULL;
+}
+
+static void sleepfor(double secs)
+{
+	struct timespec ts = {
+		.tv_sec = secs,
+		.tv_nsec = (secs - (time_t)secs) * 1e9,
+	};
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Returns the next key of the script once its delay is up, or ERR if
+ * the script has run out or `ms` milliseconds (unless negative) pass
+ * first.  The delay runs from when the key is first asked for, so the
+ * editor can get on with other work, like draining streams, between
+ * asking again.
+ */
+static int replaykey(int ms)
+{
+	struct scriptkey *sk;
+	double t = now();
+	if (!waiting && nextkey > 0)
+		latency[nextkey - 1] = t - delivered;
+	if (nextkey == nscript)
+		return ERR;
+	sk = &script[nextkey];
+	if (!waiting) {
+		waiting = 1;
+		due = t + sk->delay / 1000.0;
+	}
+	if (due > t) {
+		if (ms >= 0 && ms < (due - t) * 1000) {
+			sleepfor(ms / 1000.0);
+			return ERR;
+		}
+		sleepfor(due - t);
+	}
+	waiting = 0;
+	nextkey++;
+	delivered = now();
+	return sk->key;
+}
+
+int getkey(void)
+{
+	return keywithin(-1);
+}
+
+/* getkey, but a replayed key still waiting out its delay after `ms`
+ * milliseconds (unless negative) gives ERR. */
+static int keywithin(int ms)
+{
+	int c = ERR;
+	if (script && nextkey <= nscript) {
+		c = replaykey(ms);
+		if (c == ERR && nextkey < nscript)
+			return ERR;
+	}
+	if (c == ERR && script) {
+		/* The script has run out.  Without a terminal to take
+		 * over, that's the end of the session. */
+		nextkey = nscript + 1;
+		if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+			endwin();
+			replayreport(stderr);
+			exit(0);
+		}
+	}
+	if (c == ERR)
+		c = getch();
+	if (recf && c != ERR) {
+		double t = now();
+		int ms = lastrec ? (int)((t - lastrec) * 1000) : 0;
+		lastrec = t;
+		if (ms > 0)
+			fprintf(recf, "+%d ", ms);
+		putkey(recf, c);
+		fflush(recf);
+	}
+	if (c != ERR)
+		TRACE_KEY();
+	return c;
+}
+
+int pollkey(int ms)
+{
+	int c;
+	if (script && nextkey < nscript)
+		return keywithin(ms);
+	timeout(ms);
+	c = getkey();
+	timeout(-1);
+	return c;
+}
+
+int readykey(void)
+{
+	if (script && nextkey <= nscript)
+		return nextkey < nscript && script[nextkey].delay == 0 ?
+		       getkey() : ERR;
+	return pollkey(0);
+}
+
+void bracketpaste(int on)
+{
+	static int defined;
+	if (!isatty(STDOUT_FILENO))
+		return;
+	if (!defined) {
+		define_key("\033[200~", KEY_PASTE);
+		define_key("\033[201~", KEY_PASTEEND);
+		defined = 1;
+	}
+	fputs(on ? "\033[?2004h" : "\033[?2004l", stdout);
+	fflush(stdout);
+}
+
+static int cmpd(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void replayreport(FILE *f)
+{
+	double *sorted, total = 0;
+	int n, i, j, worst[5];
+	n = nextkey > nscript ? nscript : nextkey - 1;
+	if (!script || n <= 0)
+		return;
+	if (!(sorted = malloc(n * sizeof(*sorted))))
+		return;
+	for (i = 0; i < n; i++)
+		total += sorted[i] = latency[i];
+	qsort(sorted, n, sizeof(*sorted), cmpd);
+	fprintf(f, "replay: %d keys in %.3f ms\n", n, total * 1e3);
+	fprintf(f, "latency (ms): mean %.3f  p50 %.3f  p90 %.3f  "
+	        "p99 %.3f  max %.3f\n", total / n * 1e3,
+	        sorted[n / 2] * 1e3, sorted[n * 9 / 10] * 1e3,
+	        sorted[n * 99 / 100] * 1e3, sorted[n - 1] * 1e3);
+	/* The slowest few keys, to point at what regressed. */
+	for (i = 0; i < 5 && i < n; i++) {
+		worst[i] = -1;
+		for (j = 0; j < n; j++) {
+			int k, taken = 0;
+			for (k = 0; k < i; k++)
+				taken |= worst[k] == j;
+			if (!taken && (worst[i] < 0 ||
+			    latency[j] > latency[worst[i]]))
+				worst[i] = j;
+		}
+		fprintf(f, "  line %d: %.3f ms\n", script[worst[i]].line,
+		        latency[worst[i]] * 1e3);
+	}
+	free(sorted);
+}
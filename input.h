@@ -0,0 +1,53 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdio.h>
+
+/*
+ * All keyboard input goes through getkey, so that a session can be
+ * recorded to a key script and replayed from one.  A key script has one
+ * key per line, optionally preceded by a delay:
+ *
+ *	[+ms ]key
+ *
+ * where key is a single printable character, one of \e \r \n \t \s
+ * (space) \\, ^X for a control character, <down> <up> <npage> <ppage>
+ * <backspace> <paste> </paste>, or #n for any other key code.  Lines
+ * starting with "# " and empty lines are ignored.  A replay waits `ms`
+ * milliseconds before delivering a key.
+ */
+
+/* Start replaying keys from `path` / recording keys to `path`.  Return
+ * 0 on success and -1 on failure. */
+int replayfrom(char *path);
+int recordto(char *path);
+int replaying(void);
+
+/*
+ * Returns the next key, from the replay script while it lasts and from
+ * the terminal otherwise.  If a replay runs out without a terminal to
+ * fall back on, the replay report is printed and the editor exits.
+ */
+int getkey(void);
+
+/* Like getkey, but gives up after `ms` milliseconds and returns ERR.  A
+ * replayed key's delay is waited out over as many calls as it takes, so
+ * the caller can drain streams in the meantime. */
+int pollkey(int ms);
+
+/* Returns the next key if it's already waiting, without blocking, and
+ * ERR otherwise.  A replayed key is waiting unless it has a delay. */
+int readykey(void);
+
+/*
+ * While bracketed paste is on, the terminal marks pasted text: getkey
+ * returns KEY_PASTE, then the pasted bytes, then KEY_PASTEEND.  Insert
+ * mode turns it on so that a paste can go in as one insert; elsewhere a
+ * paste is still typed key by key.  It does nothing without a terminal.
+ */
+#define KEY_PASTE 0700
+#define KEY_PASTEEND 0701
+void bracketpaste(int on);
+
+/* Prints how long each replayed key took to handle, from its delivery
+ * until the editor asked for the next key. */
+void replayreport(FILE *f);
@@ -1,16 +1,24 @@
 #include <curses.h>
 #include <ctype.h>
+#include <stdlib.h>
 
 #include "buffer.h"
 #include "draw.h"
+#include "err.h"
+#include "input.h"
 #include "insert.h"
 #include "undo.h"
 
 #define C_D 4
 #define C_W 23
 #define KEY_ESCAPE 27
+/* Typed characters are inserted in runs of up to this many. */
+#define RUNSZ 4096
 
 static int ruboutword(char **t);
+static char *insertrun(char *run, size_t n, char *t);
+static char *insertpaste(char *t);
+static int insertloop(char *filename, char *t);
 
 /* Deletes a word.  `t` is a pointer to a buffer pointer.  The pointer will
  * be moved back to before the previous word, and delete will be called to
@@ -39,17 +47,69 @@ static int ruboutword(char **t)
 	return 0;
 }
 
+/* Inserts the n characters typed into run at t and records them for
+ * undo.  Returns a pointer past them, or NULL if there is an error. */
+static char *insertrun(char *run, size_t n, char *t)
+{
+	if (n == 0)
+		return t;
+	if (!(t = bufinsertstr(run, run + n, t)))
+		return NULL;
+	if (recinsert(t, t + n) < 0)
+		return NULL;
+	return t + n;
+}
+
+/* Reads a bracketed paste up to its end and inserts it at t as it is,
+ * apart from turning the terminal's returns into newlines.  Returns a
+ * pointer past it, or NULL if there is an error. */
+static char *insertpaste(char *t)
+{
+	char *p = NULL, *np;
+	size_t n = 0, alloc = 0;
+	int c;
+	while ((c = getkey()) != KEY_PASTEEND && c != ERR) {
+		if (c > 0xff)
+			continue;
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : RUNSZ;
+			if (!(np = realloc(p, alloc))) {
+				free(p);
+				seterr("memory");
+				return NULL;
+			}
+			p = np;
+		}
+		p[n++] = c == '\r' ? '\n' : c;
+	}
+	t = insertrun(p, n, t);
+	free(p);
+	return t;
+}
+
+int insertmode(char *filename, char *t)
+{
+	int err;
+	bracketpaste(1);
+	err = insertloop(filename, t);
+	bracketpaste(0);
+	return err;
+}
+
 /*
  * Reads user input and updates the buffer / screen while the user is
- * inserting text.  Returns a pointer past the end of the inserted text,
- * or NULL if there is an error.
+ * inserting text.  Keys that arrive together, as when text is pasted
+ * into the terminal, are all applied before the screen is redrawn, and
+ * runs of plain characters go into the buffer in one insert, as does a
+ * bracketed paste.  Returns 0, or -1 if there is an error.
  */
-int insertmode(char *filename, char *t)
+static int insertloop(char *filename, char *t)
 {
-	int c;
+	char run[RUNSZ];
+	int c, n;
 	for (;;) {
 		refresh_bounds();
-		if (t > winend())
+		while (t > winend())
 			adjust_scroll(winrows() / 2);
 		clrscreen();
 		drawtext();
@@ -57,37 +117,45 @@ int insertmode(char *filename, char *t)
 		drawmodeline(filename, "INSERT");
 		movecursor(t);
 		present();
-		c = getch();
-		if (c == '\r')
-			c = '\n';
-		if (c == C_D || c == KEY_ESCAPE)
-			break;
-		if (c == KEY_BACKSPACE || c == 127) {
-			if (t <= getbufstart())
+		n = 0;
+		for (c = getkey(); c != ERR; c = readykey()) {
+			if (c == '\r')
+				c = '\n';
+			if ((isgraph(c) || isspace(c)) && n < RUNSZ) {
+				run[n++] = c;
 				continue;
-			t--;
-			if (recdelete(t, t+1) < 0)
+			}
+			if (!(t = insertrun(run, n, t)))
 				return -1;
-			bufdelete(t, t + 1);
-			continue;
-		}
-		if (c == C_W) {
-			if (t <= getbufstart())
+			n = 0;
+			if (c == C_D || c == KEY_ESCAPE)
+				return 0;
+			if (c == KEY_PASTE) {
+				if (!(t = insertpaste(t)))
+					return -1;
 				continue;
-			t--;
-			if (ruboutword(&t) < 0)
-				return -1;
-			continue;
-		}
-		if (!isgraph(c) && !isspace(c)) {
-			continue;
+			}
+			if (c == KEY_BACKSPACE || c == 127) {
+				if (t <= getbufstart())
+					continue;
+				t--;
+				if (recdelete(t, t+1) < 0)
+					return -1;
+				bufdelete(t, t + 1);
+				continue;
+			}
+			if (c == C_W) {
+				if (t <= getbufstart())
+					continue;
+				t--;
+				if (ruboutword(&t) < 0)
+					return -1;
+				continue;
+			}
+			if (isgraph(c) || isspace(c))
+				run[n++] = c;
 		}
-		if (!(t = bufinsert(c, t)))
-			return -1;
-		if (recinsert(t, t + 1) < 0)
+		if (!(t = insertrun(run, n, t)))
 			return -1;
-		else
-			t++;
 	}
-	return 0;
 }
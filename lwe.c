@@ -2,21 +2,30 @@
 #include <assert.h>
 #include <ctype.h>
 #include <curses.h>
-#include <regex.h>
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "bang.h"
 #include "buffer.h"
+#include "diff.h"
 #include "draw.h"
 #include "err.h"
+#include "filter.h"
+#include "input.h"
 #include "insert.h"
+#include "re.h"
+#include "stats.h"
+#include "stream.h"
+#include "subst.h"
+#include "text.h"
+#include "trace.h"
 #include "undo.h"
 #include "yank.h"
 
 #define bufempty() (getbufstart() == getbufend())
-#define screenline(n) (skipscreenlines(winstart(), n))
 #define NULL_LINERANGE ((struct linerange) {.start = NULL, .end = NULL})
 
 struct range {
@@ -46,7 +55,12 @@ struct yankstr {
 	char *end;
 };
 
+#define MAXBUFS 26
+/* How often the command loop looks for streamed input, in ms. */
+#define STREAMPOLL 100
+
 #define C_D 4
+#define C_T 20
 #define C_U 21
 
 static char *find(char c, int n);
@@ -55,6 +69,7 @@ static int lineselected(int lvl, int off);
 static int getoffset(int lvl, int off);
 static int huntline(void);
 static void delete(char *start, char *end);
+static int cut(char *start, char *end);
 static enum loopsig scrolldown(void);
 static enum loopsig scrollup(void);
 static enum loopsig quitcmd(void);
@@ -82,6 +97,8 @@ static enum loopsig preputcmd(void);
 static enum loopsig putcmd(void);
 static enum loopsig insertlinecmd(void);
 static enum loopsig appendlinecmd(void);
+static int patchhunks(char *start, struct hunk *h, long n, char *buf,
+                      struct text *t);
 static int ranged_bang(char *start, char *end);
 static enum loopsig bangcmd(void);
 static enum loopsig banglinescmd(void);
@@ -91,11 +108,24 @@ static enum loopsig redocmd(void);
 static enum loopsig preputlinecmd(void);
 static enum loopsig putlinecmd(void);
 static enum loopsig directionalsearch(char *search_prompt, int delta);
+static int ranged_replace(char *start, char *end);
+static enum loopsig replacelinescmd(void);
+static enum loopsig replaceallcmd(void);
 static enum loopsig searchcmd(void);
 static enum loopsig rsearchcmd(void);
+static enum loopsig statscmd(void);
+static enum loopsig buffercmd(void);
+static void switchbuf(int n);
+#ifdef LWE_TRACE
+static enum loopsig tracecmd(void);
+#endif
 static int cmdloop(void);
+static int parseopts(int argc, char **argv);
 
 static char *filename, *mode;
+static struct buffer *bufs[MAXBUFS];
+static char *bufnames[MAXBUFS];
+static int nbufs, curbuf, follow, view;
 static char current_search[8192];
 
 /* The list of all commands.  Unused entries will be NULL.  A character
@@ -118,6 +148,7 @@ static command_fn cmdtbl[512] = {
 	['I'] = insertlinecmd,
 	['O'] = preputlinecmd,
 	['P'] = putlinecmd,
+	['R'] = replacelinescmd,
 	['Y'] = yanklinescmd,
 	['a'] = appendcmd,
 	['c'] = changecmd,
@@ -135,6 +166,36 @@ static command_fn cmdtbl[512] = {
 	['y'] = yankcmd,
 	['/'] = searchcmd,
 	['?'] = rsearchcmd,
+	['%'] = replaceallcmd,
+	['='] = statscmd,
+	['b'] = buffercmd,
+#ifdef LWE_TRACE
+	[C_T] = tracecmd,
+#endif
+};
+
+/* The commands that leave the buffer alone, which are all that -v
+ * allows.  They never touch the undo list or the yank ring. */
+static command_fn viewtbl[512] = {
+	[C_D] = scrolldown,
+	[KEY_DOWN] = scrolldown,
+	[KEY_NPAGE] = scrolldown,
+	['j'] = scrolldown,
+	[C_U] = scrollup,
+	[KEY_UP] = scrollup,
+	[KEY_PPAGE] = scrollup,
+	['k'] = scrollup,
+	['g'] = jumptolinecmd,
+	['n'] = lineoverlaycmd,
+	['q'] = quitcmd,
+	['s'] = togglewhitespacecmd,
+	['/'] = searchcmd,
+	['?'] = rsearchcmd,
+	['='] = statscmd,
+	['b'] = buffercmd,
+#ifdef LWE_TRACE
+	[C_T] = tracecmd,
+#endif
 };
 
 /* Finds the nth occurance of character c within the window.  Returns a
@@ -173,7 +234,7 @@ static int lineselected(int lvl, int off)
  * and calculates the offset for the next layer of disambiguation. */
 static int getoffset(int lvl, int off)
 {
-	char c = getch();
+	char c = getkey();
 	int i = c - 'a';
 	if (i < 0 || i >= 26)
 		return -1;
@@ -212,6 +273,25 @@ static void delete(char *start, char *end)
 	refresh_bounds();
 }
 
+/* Yanks and deletes some text, recording the delete for undo.  The text
+ * is copied out of the buffer once and that copy is shared by the yank
+ * ring and the undo list.  Returns 0 on success and -1 on failure. */
+static int cut(char *start, char *end)
+{
+	struct text *t;
+	if (!(t = textnew(start, end)))
+		return -1;
+	yank_storetext(t);
+	saveyanks();
+	if (recdeletetext(start, end, t) < 0) {
+		textunref(t);
+		return -1;
+	}
+	textunref(t);
+	delete(start, end);
+	return 0;
+}
+
 static enum loopsig scrolldown(void)
 {
 	adjust_scroll(LINES / 2);
@@ -267,7 +347,7 @@ static char *hunt(void)
 	draw_eof();
 	drawmodeline(filename, mode);
 	present();
-	c = getch();
+	c = getkey();
 	if (!isgraph(c) && !isspace(c))
 		return NULL;
 	return disamb(c);
@@ -310,7 +390,7 @@ static enum loopsig writecmd(void)
 		snprintf(messagebuf, sizeof(messagebuf), "Error -- failed to write to file: %s", filename);
 		drawmessage(messagebuf);
 		present();
-		getch();
+		getkey();
 	}
 	return LOOP_SIGCNT;
 }
@@ -352,12 +432,9 @@ static enum loopsig deletecmd(void)
 	huntrange(&r);
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
-	saveyanks();
-	if (recdelete(r.start, r.end) < 0)
+	if (cut(r.start, r.end) < 0)
 		return LOOP_SIGERR;
 	recstep();
-	delete(r.start, r.end);
 	return LOOP_SIGCNT;
 }
 
@@ -368,11 +445,8 @@ static enum loopsig changecmd(void)
 	huntrange(&r);
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
-	saveyanks();
-	if (recdelete(r.start, r.end) < 0)
+	if (cut(r.start, r.end) < 0)
 		return LOOP_SIGERR;
-	delete(r.start, r.end);
 	if (insertmode(filename, r.start) < 0)
 		return LOOP_SIGERR;
 	recstep();
@@ -398,7 +472,7 @@ static int queryuser(char *out, int out_sz, char *prompt)
 		draw_eof();
 		drawmessage(msgbuf);
 		present();
-		int c = getch();
+		int c = getkey();
 		if (c == '\r') {
 			return 0;
 		} else if (c == C_D) {
@@ -418,7 +492,7 @@ static int queryuser(char *out, int out_sz, char *prompt)
 	clrscreen();
 	drawtext();
 	drawmessage("Input too long");
-	getch();
+	getkey();
 	return -1;
 }
 
@@ -476,10 +550,10 @@ static struct linerange huntlinerange(void)
 	if (endoffset == -1)
 		return NULL_LINERANGE;
 	orienti(&startoffset, &endoffset);
-	char *start = bufline(winstart(), startoffset);
+	char *start = bufline(winline(), startoffset);
 	if (start == NULL)
 		return NULL_LINERANGE;
-	char *lstart = bufline(winstart(), endoffset);
+	char *lstart = bufline(winline(), endoffset);
 	if (lstart == NULL)
 		return NULL_LINERANGE;
 	char *end = endofline(lstart);
@@ -494,12 +568,9 @@ static enum loopsig deletelinescmd(void)
 	struct linerange r = huntlinerange();
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
-	saveyanks();
-	if (recdelete(r.start, r.end) < 0)
+	if (cut(r.start, r.end) < 0)
 		return LOOP_SIGERR;
 	recstep();
-	delete(r.start, r.end);
 	return LOOP_SIGCNT;
 }
 
@@ -510,11 +581,8 @@ static enum loopsig changelinescmd(void)
 	r = huntlinerange();
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
-	saveyanks();
-	if (recdelete(r.start, r.end) < 0)
+	if (cut(r.start, r.end) < 0)
 		return LOOP_SIGERR;
-	delete(r.start, r.end);
 	if (insertmode(filename, r.start) < 0)
 		return LOOP_SIGERR;
 	recstep();
@@ -530,7 +598,7 @@ static enum loopsig lineoverlaycmd(void)
 	drawmodeline(filename, mode);
 	drawlineoverlay();
 	present();
-	getch();
+	getkey();
 	return LOOP_SIGCNT;
 }
 
@@ -541,7 +609,8 @@ static enum loopsig yankcmd(void)
 	huntrange(&r);
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
+	if (yank_store(r.start, r.end) < 0)
+		return LOOP_SIGERR;
 	saveyanks();
 	return LOOP_SIGCNT;
 }
@@ -552,7 +621,8 @@ static enum loopsig yanklinescmd(void)
 	struct linerange r = huntlinerange();
 	if (!r.start || !r.end)
 		return LOOP_SIGCNT;
-	yank_store(r.start, r.end);
+	if (yank_store(r.start, r.end) < 0)
+		return LOOP_SIGERR;
 	saveyanks();
 	return LOOP_SIGCNT;
 }
@@ -564,12 +634,13 @@ static struct yankstr yankhunt(void)
 	clrscreen();
 	drawyanks();
 	present();
-	int selected = getch() - 'a';
+	int selected = getkey() - 'a';
 	if (selected < 0 || selected >= yank_sz())
 		return (struct yankstr) {NULL, NULL};
 	struct yankstr result;
-	unsigned ysz;
-	yank_item(&result.start, &ysz, selected);
+	size_t ysz;
+	if (yank_item(&result.start, &ysz, selected) < 0)
+		return (struct yankstr) {NULL, NULL};
 	result.end = result.start + ysz;
 	return result;
 }
@@ -628,7 +699,7 @@ static enum loopsig insertlinecmd(void)
 		lineno = huntline();
 	if (lineno == -1)
 		return LOOP_SIGCNT;
-	if(!(t = bufline(winstart(), lineno)))
+	if(!(t = bufline(winline(), lineno)))
 		return LOOP_SIGCNT;
 	if (!(t = bufinsert('\n', t)))
 		return LOOP_SIGERR;
@@ -651,7 +722,7 @@ static enum loopsig appendlinecmd(void)
 		lineno = huntline();
 	if (lineno == -1)
 		return LOOP_SIGCNT;
-	lns = bufline(winstart(), lineno);
+	lns = bufline(winline(), lineno);
 	if(lns == NULL)
 		return LOOP_SIGCNT;
 	lne = endofline(lns);
@@ -665,41 +736,106 @@ static enum loopsig appendlinecmd(void)
 	return LOOP_SIGCNT;
 }
 
+/*
+ * Replaces each of the n hunks of the text at start with its new text
+ * from buf, in one bufpatch, and records them for undo as one step.
+ * With one hunk, undo shares t, which holds its old text, if given.
+ */
+static int patchhunks(char *start, struct hunk *h, long n, char *buf,
+                      struct text *t)
+{
+	struct patch *p;
+	long i;
+	if (!(p = malloc(n * sizeof(*p)))) {
+		seterr("memory");
+		return -1;
+	}
+	/* Recorded back to front, the offsets of each hunk hold in the
+	 * text as undo finds it. */
+	for (i = n - 1; i >= 0; i--) {
+		if (recreplacetext(start + h[i].a, start + h[i].a + h[i].na,
+		                   h[i].nb, n == 1 ? t : NULL) < 0) {
+			free(p);
+			return -1;
+		}
+		p[i] = (struct patch) {
+			.off = start - getbufstart() + h[i].a,
+			.len = h[i].na,
+			.data = buf + h[i].b,
+			.sz = h[i].nb
+		};
+	}
+	if (bufpatch(p, n) < 0) {
+		free(p);
+		return -1;
+	}
+	free(p);
+	recstep();
+	return 0;
+}
+
+/*
+ * Filters [start, end) through a shell command, or one of the filters
+ * built in (see filter.h).  A command run again on the same text, after
+ * an undo say, gives what it gave before without being run.  Only the
+ * lines the command changed are replaced and recorded for undo, so a
+ * formatter run over a big file costs about what it changed.
+ */
 static int ranged_bang(char *start, char *end)
 {
-	char cmd[8192];
+	char cmd[8192], *q;
 	int err;
-	struct bang_output o;
-	struct bang_output e;
+	long n, i;
+	size_t sz;
+	struct hunk *h = NULL;
+	struct text *y = NULL;
+	struct bang_output o = { NULL, 0 };
+	struct bang_output e = { NULL, 0 };
 	if (queryuser(cmd, sizeof(cmd), "COMMAND") < 0) {
 		return 0;
 	}
-	if (bang(&o, &e, cmd, start, end - start) < 0) {
+	if ((n = runfilter(&o, cmd, start, end - start)) < 0) {
+		err = -1;
+		goto cleanup;
+	}
+	if (n == 0 && bangmemo(&o, &e, cmd, start, end - start) < 0) {
 		clrscreen();
 		drawmessage(e.buf);
 		present();
-		getch();
+		getkey();
 		err = 0;
 		goto cleanup;
 	}
 	err = 0;
-	yank_store(start, end);
-	saveyanks();
-	if (recdelete(start, end) < 0) {
-		err = -1;
+	if ((n = linediff(start, end - start, o.buf, o.sz, &h)) <= 0) {
+		err = n;
 		goto cleanup;
 	}
-	bufdelete(start, end);
-	if (!(start = bufinsertstr(o.buf, o.buf + o.sz, start))) {
-		err = -1;
-		goto cleanup;
+	/* The lines the command changed are yanked, as a cut's are, and
+	 * only they are copied.  With one hunk undo shares the copy. */
+	for (i = 0, sz = 0; i < n; i++)
+		sz += h[i].na;
+	if (sz > 0) {
+		if (!(y = textalloc(sz))) {
+			err = -1;
+			goto cleanup;
+		}
+		for (i = 0, q = textdata(y); i < n; i++) {
+			memcpy(q, start + h[i].a, h[i].na);
+			q += h[i].na;
+		}
 	}
-	if (recinsert(start, start + o.sz) < 0) {
+	if (patchhunks(start, h, n, o.buf, y) < 0) {
 		err = -1;
 		goto cleanup;
 	}
-	recstep();
+	if (y) {
+		yank_storetext(y);
+		saveyanks();
+	}
 cleanup:
+	textunref(y);
+	free(h);
 	free(o.buf);
 	free(e.buf);
 	refresh_bounds();
@@ -762,7 +898,7 @@ static enum loopsig preputlinecmd(void)
 	l = huntline();
 	if (l < 0)
 		return LOOP_SIGCNT;
-	if (!(t = bufline(winstart(), l)))
+	if (!(t = bufline(winline(), l)))
 		return LOOP_SIGCNT;
 	y = yankhunt();
 	if (!y.start || !y.end)
@@ -787,7 +923,7 @@ static enum loopsig putlinecmd(void)
 	l = huntline();
 	if (l < 0)
 		return LOOP_SIGCNT;
-	if (!(t = bufline(winstart(), l)))
+	if (!(t = bufline(winline(), l)))
 		return LOOP_SIGCNT;
 	t = endofline(t);
 	if (t != getbufend())
@@ -808,62 +944,46 @@ static enum loopsig putlinecmd(void)
 
 static enum loopsig directionalsearch(char *search_prompt, int delta)
 {
-	char rebuf[8192];
-	regex_t reg;
-	char *cpos, *spos, *e, *i;
-	int err, n;
+	char rebuf[8192], msg[256];
+	struct re *re;
+	char *cpos, *spos, *e, *f;
 	if (queryuser(rebuf, sizeof(rebuf), search_prompt) < 0)
 		return LOOP_SIGCNT;
 	if (rebuf[0] != '\0')
 		snprintf(current_search, sizeof(current_search), "%s", rebuf);
-	if ((err = regcomp(&reg, current_search, REG_EXTENDED)) != 0) {
-		regerror(err, &reg, current_search, sizeof(current_search));
+	if (!(re = recomp(current_search, msg, sizeof(msg)))) {
 		clrscreen();
 		drawtext();
 		draw_eof();
-		drawmessage(current_search);
+		drawmessage(msg);
 		present();
-		getch();
+		getkey();
 		return LOOP_SIGCNT;
 	}
 	spos = winstart();
 	if (delta > 0) {
-		cpos = endofline(spos);
-		if (cpos >= getbufend())
-			cpos = getbufstart();
+		/* The lines after this one, then the ones before it. */
+		e = endofline(spos);
+		f = e < getbufend() ? refind(re, e + 1, getbufend()) : NULL;
+		if (!f)
+			f = refind(re, getbufstart(), spos);
+		cpos = f ? f : spos;
 	} else {
-		if (spos == getbufstart())
-			cpos = getbufend();
-		else
-			cpos = spos - 1;
-	}
-	while (cpos != spos) {
-		e = endofline(cpos);
-		if (*e == '\n') {
-			*e = '\0';
-			err = regexec(&reg, cpos, 0, NULL, 0);
-			*e = '\n';
-		} else {
-			err = regexec(&reg, cpos, 0, NULL, 0);
-		}
-		if (!err)
-			break;
-		if (delta > 0) {
-			cpos = e + 1;
-			if (cpos >= getbufend())
-				cpos = getbufstart();
-		} else {
+		/* Walk back a line at a time, wrapping at the top. */
+		for (cpos = spos;;) {
 			if (cpos == getbufstart())
 				cpos = getbufend();
-			else
+			if (cpos == getbufstart())
+				break;
+			e = cpos[-1] == '\n' ? cpos - 1 : cpos;
+			for (cpos = e; cpos > getbufstart() && cpos[-1] != '\n';)
 				cpos--;
+			if (cpos == spos || rematch(re, cpos, e))
+				break;
 		}
 	}
-	regfree(&reg);
-	n = 0;
-	for (i = getbufstart(); i < cpos; ++i)
-		if (*i == '\n') n++;
-	set_scroll(n);
+	refree(re);
+	set_scroll(countwithin(getbufstart(), cpos, '\n'));
 	return LOOP_SIGCNT;
 }
 
@@ -877,20 +997,168 @@ static enum loopsig rsearchcmd(void)
 	return directionalsearch("?", -1);
 }
 
+/*
+ * Asks for a pattern and what to replace it with, then replaces every
+ * match in [start, end).  The new text is built in one pass and patched
+ * in a line at a time with a single move, and undo records just the
+ * lines with matches, as one step.  An empty pattern repeats the last
+ * search.  Returns -1 on a fatal error.
+ */
+static int ranged_replace(char *start, char *end)
+{
+	char rebuf[8192], with[8192], msg[256];
+	struct subst_output o;
+	struct re *re;
+	int err;
+	if (queryuser(rebuf, sizeof(rebuf), "REPLACE") < 0)
+		return 0;
+	if (rebuf[0] != '\0')
+		snprintf(current_search, sizeof(current_search), "%s", rebuf);
+	if (queryuser(with, sizeof(with), "WITH") < 0)
+		return 0;
+	if ((re = recomp(current_search, msg, sizeof(msg)))) {
+		err = subst(&o, re, with, start, end);
+		refree(re);
+		if (err < 0)
+			return -1;
+		if (o.nh > 0 && patchhunks(start, o.h, o.nh, o.buf, NULL) < 0)
+			err = -1;
+		free(o.buf);
+		free(o.h);
+		refresh_bounds();
+		if (err < 0)
+			return -1;
+		snprintf(msg, sizeof(msg), "%zu replaced", o.n);
+	}
+	clrscreen();
+	drawtext();
+	draw_eof();
+	drawmessage(msg);
+	present();
+	getkey();
+	return 0;
+}
+
+static enum loopsig replacelinescmd(void)
+{
+	mode = "TARGET LINES (REPLACE)";
+	struct linerange r = huntlinerange();
+	if (!r.start || !r.end)
+		return LOOP_SIGCNT;
+	if (ranged_replace(r.start, r.end) < 0)
+		return LOOP_SIGERR;
+	return LOOP_SIGCNT;
+}
+
+static enum loopsig replaceallcmd(void)
+{
+	if (ranged_replace(getbufstart(), getbufend()) < 0)
+		return LOOP_SIGERR;
+	return LOOP_SIGCNT;
+}
+
+/* Shows memory use until the next key, or the buffer engine's counters
+ * if that's = again. */
+static enum loopsig statscmd(void)
+{
+	char msg[256];
+	int i;
+	for (i = 0; i < 2; i++) {
+		if (i == 0)
+			memline(msg, sizeof(msg));
+		else
+			statsline(msg, sizeof(msg));
+		clrscreen();
+		drawtext();
+		draw_eof();
+		drawmessage(msg);
+		present();
+		if (getkey() != '=')
+			break;
+	}
+	return LOOP_SIGCNT;
+}
+
+/* Makes the nth open file current.  Its undo history and scroll position
+ * come with it, so switching back and forth doesn't re-read anything. */
+static void switchbuf(int n)
+{
+	curbuf = n;
+	bufselect(bufs[n]);
+	filename = bufnames[n];
+	refresh_bounds();
+}
+
+/* Presents a menu of the open files and switches to the chosen one. */
+static enum loopsig buffercmd(void)
+{
+	clrscreen();
+	drawbuffers(bufnames, nbufs, curbuf);
+	present();
+	int selected = getkey() - 'a';
+	if (selected >= 0 && selected < nbufs)
+		switchbuf(selected);
+	return LOOP_SIGCNT;
+}
+
+#ifdef LWE_TRACE
+/* Appends the latency histograms to $LWE_TRACE (or lwe.trace). */
+static enum loopsig tracecmd(void)
+{
+	char msg[256];
+	char *path = getenv("LWE_TRACE") ? getenv("LWE_TRACE") : "lwe.trace";
+	FILE *f = fopen(path, "a");
+	if (f) {
+		tracedump(f);
+		fclose(f);
+		snprintf(msg, sizeof(msg), "Trace appended to %s", path);
+	} else {
+		snprintf(msg, sizeof(msg), "Error -- can't write %s", path);
+	}
+	clrscreen();
+	drawtext();
+	draw_eof();
+	drawmessage(msg);
+	present();
+	getkey();
+	return LOOP_SIGCNT;
+}
+#endif
+
 static int cmdloop(void)
 {
+	char err[256], notice[256 + 16] = "";
 	set_scroll(0);
 	for (;;) {
-		mode = "COMMAND";
+		/* Streamed input is only added here, between commands.  A
+		 * followed file that was showing its end keeps doing so. */
+		int atend = winend() == getbufend();
+		int grew = streamdrain();
+		if (grew < 0) {
+			/* Only the stream that failed has stopped, so rather
+			 * than lose the buffers, say why until the next key. */
+			geterr(err, sizeof(err));
+			seterr("");
+			snprintf(notice, sizeof(notice), "Error -- %s", err);
+			grew = 1;
+		}
+		if (grew && atend && streamfollowing(bufcurrent()))
+			scroll_to_end();
+		else if (grew)
+			refresh_bounds();
+		mode = view ? "VIEW" : "COMMAND";
 		clrscreen();
 		drawtext();
 		draw_eof();
 		drawmodeline(filename, mode);
+		if (notice[0])
+			drawmessage(notice);
 		present();
-		int c = getch();
+		int c = streaming() ? pollkey(STREAMPOLL) : getkey();
 		if (c == ERR)
 			continue;
-		command_fn cmd = cmdtbl[c];
+		notice[0] = '\0';
+		command_fn cmd = view ? viewtbl[c] : cmdtbl[c];
 		if (cmd == NULL)
 			continue;
 		enum loopsig s = cmd();
@@ -902,22 +1170,87 @@ static int cmdloop(void)
 	return 0;
 }
 
-int main(int argc, char **argv)
+/* Handles command line options.  Returns 0 on success and -1 (with the
+ * error set) on failure. */
+static int parseopts(int argc, char **argv)
 {
-	initcurses();
+	char *e;
+	unsigned long mb;
+	int opt;
+	while ((opt = getopt(argc, argv, "fr:R:u:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			follow = 1;
+			break;
+		case 'v':
+			view = 1;
+			break;
+		case 'r':
+			if (replayfrom(optarg) < 0)
+				return -1;
+			break;
+		case 'R':
+			if (recordto(optarg) < 0)
+				return -1;
+			break;
+		case 'u':
+			mb = strtoul(optarg, &e, 10);
+			if (*optarg == '\0' || *e != '\0') {
+				seterr("-u takes a size in MB");
+				return -1;
+			}
+			undobudget((size_t)mb << 20);
+			break;
+		default:
+			seterr("usage: lwe [-fv] [-r keys] [-R keys] [-u MB] "
+			       "file...");
+			return -1;
+		}
+	}
+	return 0;
+}
 
-	if (argc != 2) {
+int main(int argc, char **argv)
+{
+	char errbuf[256];
+	/* Character widths come from the user's locale. */
+	setlocale(LC_ALL, "");
+	if (parseopts(argc, argv) < 0)
+		goto report;
+	if (optind == argc) {
 		seterr("missing file arg");
+	} else if (argc - optind > MAXBUFS) {
+		seterr("too many files");
 	} else {
-		filename = argv[1];
-		loadyanks();
-		if (bufread(filename) == 0)
+		for (nbufs = 0; optind + nbufs < argc; nbufs++) {
+			bufnames[nbufs] = argv[optind + nbufs];
+			/* Only a file that won't grow can be mapped. */
+			if (view && !follow && !streamable(bufnames[nbufs]))
+				bufs[nbufs] = bufview(bufnames[nbufs]);
+			else
+				bufs[nbufs] = bufopen(bufnames[nbufs]);
+			if (!bufs[nbufs])
+				break;
+			if (streamable(bufnames[nbufs])) {
+				if (streamopen(bufs[nbufs], bufnames[nbufs]) < 0)
+					break;
+			} else if (follow && streamfollow(bufs[nbufs],
+			           bufnames[nbufs], getbufend() - getbufstart()) < 0) {
+				break;
+			}
+		}
+		/* A replay without a terminal draws to nowhere. */
+		int headless = replaying() &&
+		               (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO));
+		if (optind + nbufs == argc && initcurses(headless) == 0) {
+			switchbuf(0);
 			cmdloop();
+			endwin();
+			replayreport(stderr);
+		}
 	}
 
-	endwin();
-
-	char errbuf[256];
+report:
 	geterr(errbuf, sizeof(errbuf));
 	if (errbuf[0] == '\0') {
 		return 0;
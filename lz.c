@@ -0,0 +1,169 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * The compressed data is a series of sequences: some literal bytes,
+ * then a match that copies earlier output.
+ *
+ *	token	literal count in the high nibble, match length - 4 in
+ *		the low; 15 means more bytes follow, each adding 0-255,
+ *		up to one that's below 255
+ *	literals
+ *	offset	2 bytes, little endian, back from the end of the output
+ *
+ * The last sequence stops after its literals.
+ */
+#define MINMATCH 4
+#define MAXOFF 65535
+#define HASHBITS 16
+/* Matches stop this far from the end, so the last sequence has room to
+ * be all literals and reading four bytes ahead stays in bounds. */
+#define TAIL 8
+
+static uint32_t read32(const unsigned char *p);
+static unsigned hash(uint32_t v);
+static unsigned char *putcount(unsigned char *o, size_t n);
+static unsigned char *putseq(unsigned char *o, const unsigned char *lit,
+                             size_t nlit, size_t off, size_t mlen);
+static int getcount(const unsigned char **ip, const unsigned char *end,
+                    size_t *n);
+
+static uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static unsigned hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASHBITS);
+}
+
+/* Writes the extra count bytes for a nibble that overflowed. */
+static unsigned char *putcount(unsigned char *o, size_t n)
+{
+	for (; n >= 255; n -= 255)
+		*o++ = 255;
+	*o++ = n;
+	return o;
+}
+
+/* Writes a sequence; a match length of 0 means the last one. */
+static unsigned char *putseq(unsigned char *o, const unsigned char *lit,
+                             size_t nlit, size_t off, size_t mlen)
+{
+	unsigned char *token = o++;
+	size_t m = mlen ? mlen - MINMATCH : 0;
+	*token = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+	if (nlit >= 15)
+		o = putcount(o, nlit - 15);
+	memcpy(o, lit, nlit);
+	o += nlit;
+	if (!mlen)
+		return o;
+	*o++ = off & 255;
+	*o++ = off >> 8;
+	if (m >= 15)
+		o = putcount(o, m - 15);
+	return o;
+}
+
+static int getcount(const unsigned char **ip, const unsigned char *end,
+                    size_t *n)
+{
+	unsigned b;
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while (b == 255);
+	return 0;
+}
+
+size_t lzbound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+size_t lzpack(char *src, size_t n, char *dst)
+{
+	const unsigned char *in = (unsigned char *)src, *ip = in, *anchor = in;
+	const unsigned char *end = in + n, *limit = n > TAIL ? end - TAIL : in;
+	const unsigned char *m, *mp;
+	unsigned char *op = (unsigned char *)dst;
+	size_t *table, cand;
+	uint32_t v;
+	unsigned h;
+	/* Positions are stored plus one, so 0 means none. */
+	if (!(table = calloc(1 << HASHBITS, sizeof(*table))))
+		return 0;
+	while (ip < limit) {
+		v = read32(ip);
+		h = hash(v);
+		cand = table[h];
+		table[h] = ip - in + 1;
+		m = in + cand - 1;
+		if (!cand || ip - m > MAXOFF || read32(m) != v) {
+			/* Skip faster through text that doesn't compress. */
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+		for (mp = ip + MINMATCH, m += MINMATCH; mp < limit && *mp == *m;)
+			mp++, m++;
+		op = putseq(op, anchor, ip - anchor, mp - m, mp - ip);
+		anchor = ip = mp;
+	}
+	op = putseq(op, anchor, end - anchor, 0, 0);
+	free(table);
+	return op - (unsigned char *)dst;
+}
+
+int lzunpack(char *src, size_t n, char *dst, size_t dn)
+{
+	const unsigned char *ip = (unsigned char *)src, *end = ip + n, *m;
+	unsigned char *op = (unsigned char *)dst, *oend = op + dn;
+	size_t nlit, mlen, off;
+	unsigned token;
+	for (;;) {
+		if (ip >= end)
+			return -1;
+		token = *ip++;
+		nlit = token >> 4;
+		if (nlit == 15 && getcount(&ip, end, &nlit) < 0)
+			return -1;
+		if (nlit > (size_t)(end - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		if (ip == end)
+			return op == oend ? 0 : -1;
+		if (end - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15 && getcount(&ip, end, &mlen) < 0)
+			return -1;
+		mlen += MINMATCH;
+		if (off == 0 || off > (size_t)(op - (unsigned char *)dst) ||
+		    mlen > (size_t)(oend - op))
+			return -1;
+		m = op - off;
+		if (off >= mlen) {
+			memcpy(op, m, mlen);
+			op += mlen;
+		} else {
+			/* The match overlaps what it writes, as in a run. */
+			while (mlen--)
+				*op++ = *m++;
+		}
+	}
+}
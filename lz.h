@@ -0,0 +1,20 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 compressor in the manner of LZ4, for text that is kept
+ * but rarely read again, like old undo steps.  It goes for speed over
+ * ratio: matches are found through one hash of the next four bytes and
+ * reach back at most 64K.
+ */
+
+/* The most lzpack can write for n bytes of input. */
+size_t lzbound(size_t n);
+/* Compresses n bytes at src into dst, which must have room for
+ * lzbound(n) bytes.  Returns the compressed size, or 0 if out of
+ * memory. */
+size_t lzpack(char *src, size_t n, char *dst);
+/* Decompresses n bytes at src into exactly dn bytes at dst.  Returns 0,
+ * or -1 if the data is damaged or doesn't fill dst exactly. */
+int lzunpack(char *src, size_t n, char *dst, size_t dn);
@@ -0,0 +1,1102 @@
+/* (C) 2015 Tom Wright */
+
+/* For memmem. */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "re.h"
+
+/*
+ * The engine reads a line's bytes and then EOL.  ^ and $ compile to sets
+ * holding only the BOL or EOL marker, but they test the position rather
+ * than read anything: ^ passes in the state a line starts in, and $
+ * when EOL is read (see addthread).
+ */
+#define BOL 256
+#define EOL 257
+#define NSYM 258
+#define SETWORDS ((NSYM + 31) / 32)
+#define AT_BOL 1
+#define AT_EOL 2
+
+#define MAXREP 255		/* largest count in {m,n} */
+#define MAXPROG 4096		/* longer programs go to libc */
+#define MAXPRE 64		/* longest literal prefix kept */
+#define TABSZ 4096		/* DFA states cached, at most half this */
+#define POOLSZ (4 << 20)	/* memory for the cached states */
+#define MAXSUB 10		/* most subexpressions renext gives */
+
+struct set {
+	uint32_t w[SETWORDS];
+};
+
+enum { N_SET, N_CAT, N_ALT, N_REP, N_EMPTY, N_GROUP };
+
+struct node {
+	int type;
+	int l, r;		/* CAT and ALT use both, REP and GROUP only l */
+	int min, max;		/* REP; max is -1 without a limit.  GROUP:
+				 * min is its number */
+	int mb;			/* SET also matches any non-ASCII character */
+	struct set set;
+};
+
+struct parse {
+	char *p;
+	struct node *nodes;
+	int n, alloc, bad, ngroups;
+};
+
+enum { I_SET, I_SPLIT, I_JMP, I_SAVE, I_MATCH };
+
+struct inst {
+	int op;
+	int x, y;		/* SET: the set; SPLIT: both targets; JMP: x;
+				 * SAVE: x, the slot for the position */
+};
+
+/* A DFA state: the NFA instructions its threads are waiting at, and
+ * whether it's the start of a line. */
+struct dstate {
+	struct dstate *next[NSYM];
+	int match, bol;
+	int n;
+	int pcs[];
+};
+
+struct re {
+	/* Set when the pattern went to libc. */
+	int libc;
+	regex_t reg;
+	/* A literal every match starts with; if the whole pattern is that
+	 * literal, finding it is enough. */
+	char pre[MAXPRE];
+	int npre, literal;
+	struct inst *prog;
+	struct set *sets;
+	int nprog, nsets, alloc, salloc;
+	/* Scratch for building states. */
+	int *mark, *list, *stack, gen;
+	struct dstate **tab, *start;
+	char *pool;
+	size_t poolused, statesz;
+	int nstates, flushes;
+	/* For renext, made the first time it's called: the program
+	 * reversed, which finds where matches start, and anchored, which
+	 * finds where the longest from a start ends.  A reversed program
+	 * keeps `starts`, a bit for each place in the line [sls, se] a
+	 * match can start.  An anchored one starts away from the line's
+	 * start in `mid`. */
+	char *pattern;
+	int ngroups, reversed, anchored;
+	struct re *back, *from;
+	unsigned char *starts;
+	size_t nstarts;
+	char *sls, *se;
+	struct dstate *mid;
+	/* Subexpression positions for each thread of groups, ncap a
+	 * thread. */
+	long *caps;
+	int ncap;
+};
+
+static int newnode(struct parse *ps, int type, int l, int r);
+static int newset(struct parse *ps, struct set *s, int mb);
+static void addrange(struct set *s, int lo, int hi);
+static int inset(struct set *s, int c);
+static int addclass(struct parse *ps, struct set *s);
+static int parsealt(struct parse *ps);
+static int parsecat(struct parse *ps);
+static int parserep(struct parse *ps);
+static int parsebracket(struct parse *ps);
+static int parseatom(struct parse *ps);
+static int litprefix(struct re *re, struct parse *ps, int n, int *anchored);
+static int emit(struct re *re, int op, int x, int y);
+static int emitset(struct re *re, struct set *s);
+static int emitnode(struct re *re, struct parse *ps, int n);
+static int compile(struct re *re, char *pattern);
+static int prepare(struct re *re);
+static struct re *machine(char *pattern, int reversed);
+static int uselibc(struct re *re, char *pattern, char *err, int errsz);
+static void addthread(struct re *re, int pc, int at, int *n);
+static int cmpint(const void *a, const void *b);
+static void flush(struct re *re);
+static struct dstate *getstate(struct re *re, int *pcs, int n, int bol);
+static struct dstate *startstate(struct re *re);
+static struct dstate *step(struct re *re, struct dstate *s, int c);
+static struct dstate *midstate(struct re *re);
+static int dfamatch(struct re *re, char *p, char *e);
+static int libcmatch(struct re *re, char *p, char *e);
+static int libcnext(struct re *re, char *ls, char *p, char *e,
+                    struct resub *m, int nsub);
+static int scanstarts(struct re *re, char *ls, char *e);
+static char *longest(struct re *re, char *ls, char *s, char *e);
+static void vmadd(struct re *re, int *pcs, long *caps, int *n, int pc,
+                  long *cap, long pos, int at, int ncap);
+static int groups(struct re *re, char *ls, char *s, char *end, char *e,
+                  struct resub *m, int nsub);
+
+static int newnode(struct parse *ps, int type, int l, int r)
+{
+	struct node *nodes;
+	if (ps->bad)
+		return -1;
+	if (ps->n == ps->alloc) {
+		ps->alloc = ps->alloc ? ps->alloc * 2 : 64;
+		if (!(nodes = realloc(ps->nodes, ps->alloc * sizeof(*nodes)))) {
+			ps->bad = 1;
+			return -1;
+		}
+		ps->nodes = nodes;
+	}
+	memset(&ps->nodes[ps->n], 0, sizeof(ps->nodes[ps->n]));
+	ps->nodes[ps->n].type = type;
+	ps->nodes[ps->n].l = l;
+	ps->nodes[ps->n].r = r;
+	return ps->n++;
+}
+
+static int newset(struct parse *ps, struct set *s, int mb)
+{
+	int n = newnode(ps, N_SET, -1, -1);
+	if (n >= 0) {
+		ps->nodes[n].set = *s;
+		ps->nodes[n].mb = mb;
+	}
+	return n;
+}
+
+static void addrange(struct set *s, int lo, int hi)
+{
+	for (; lo <= hi; lo++)
+		s->w[lo / 32] |= (uint32_t)1 << (lo % 32);
+}
+
+static int inset(struct set *s, int c)
+{
+	return s->w[c / 32] >> (c % 32) & 1;
+}
+
+/* Adds a [:name:] class, with ps->p just past the "[:".  Only the
+ * classes without any non-ASCII members are taken. */
+static int addclass(struct parse *ps, struct set *s)
+{
+	static const struct {
+		char *name;
+		int (*fn)(int);
+	} classes[] = {
+		{ "digit", isdigit }, { "xdigit", isxdigit },
+	};
+	char *e = strstr(ps->p, ":]");
+	size_t i;
+	int c;
+	if (!e)
+		return -1;
+	for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+		if (strlen(classes[i].name) == (size_t)(e - ps->p) &&
+		    strncmp(classes[i].name, ps->p, e - ps->p) == 0) {
+			for (c = 0; c < 128; c++)
+				if (classes[i].fn(c))
+					addrange(s, c, c);
+			ps->p = e + 2;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static int parsealt(struct parse *ps)
+{
+	int l = parsecat(ps);
+	while (!ps->bad && *ps->p == '|') {
+		ps->p++;
+		l = newnode(ps, N_ALT, l, parsecat(ps));
+	}
+	return l;
+}
+
+static int parsecat(struct parse *ps)
+{
+	int l = -1, r;
+	while (!ps->bad && *ps->p && *ps->p != '|' && *ps->p != ')') {
+		r = parserep(ps);
+		l = l < 0 ? r : newnode(ps, N_CAT, l, r);
+	}
+	/* libc can have empty branches. */
+	if (l < 0)
+		ps->bad = 1;
+	return l;
+}
+
+static int parserep(struct parse *ps)
+{
+	int n = parseatom(ps), min, max;
+	char *e;
+	for (;;) {
+		switch (*ps->p) {
+		case '*': min = 0; max = -1; break;
+		case '+': min = 1; max = -1; break;
+		case '?': min = 0; max = 1; break;
+		case '{':
+			if (!isdigit((unsigned char)ps->p[1])) {
+				ps->bad = 1;
+				return -1;
+			}
+			min = max = strtol(ps->p + 1, &e, 10);
+			if (*e == ',')
+				max = isdigit((unsigned char)e[1]) ?
+				      strtol(e + 1, &e, 10) : (e++, -1);
+			if (*e != '}' || min > MAXREP || max > MAXREP ||
+			    (max >= 0 && max < min)) {
+				ps->bad = 1;
+				return -1;
+			}
+			ps->p = e;
+			break;
+		default:
+			return n;
+		}
+		ps->p++;
+		n = newnode(ps, N_REP, n, -1);
+		if (n < 0)
+			return -1;
+		ps->nodes[n].min = min;
+		ps->nodes[n].max = max;
+	}
+}
+
+static int parsebracket(struct parse *ps)
+{
+	struct set s = { { 0 } };
+	int neg = 0, first, lo, hi;
+	if (*ps->p == '^') {
+		neg = 1;
+		ps->p++;
+	}
+	for (first = 1; ; first = 0) {
+		lo = (unsigned char)*ps->p;
+		if (lo == ']' && !first) {
+			ps->p++;
+			break;
+		}
+		if (lo == '\0' || (lo == '[' && (ps->p[1] == '.' || ps->p[1] == '='))) {
+			ps->bad = 1;
+			return -1;
+		}
+		if (lo == '[' && ps->p[1] == ':') {
+			ps->p += 2;
+			if (addclass(ps, &s) < 0) {
+				ps->bad = 1;
+				return -1;
+			}
+			continue;
+		}
+		ps->p++;
+		hi = lo;
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			hi = (unsigned char)ps->p[1];
+			if (hi == '[' || hi < lo) {
+				ps->bad = 1;
+				return -1;
+			}
+			ps->p += 2;
+		}
+		addrange(&s, lo, hi);
+	}
+	if (neg) {
+		for (lo = 0; lo < SETWORDS; lo++)
+			s.w[lo] = ~s.w[lo];
+		memset(&s.w[128 / 32], 0, sizeof(s.w) - 128 / 8);
+	}
+	s.w['\n' / 32] &= ~((uint32_t)1 << ('\n' % 32));
+	return newset(ps, &s, neg);
+}
+
+static int parseatom(struct parse *ps)
+{
+	struct set s = { { 0 } };
+	int c = (unsigned char)*ps->p++, n;
+	switch (c) {
+	case '(':
+		c = ++ps->ngroups;
+		if (*ps->p == ')') {
+			n = -1;
+		} else {
+			n = parsealt(ps);
+			if (*ps->p != ')')
+				ps->bad = 1;
+		}
+		ps->p++;
+		if ((n = newnode(ps, N_GROUP, n, -1)) >= 0)
+			ps->nodes[n].min = c;
+		return n;
+	case '[':
+		return parsebracket(ps);
+	case '.':
+		addrange(&s, 0, 127);
+		s.w['\n' / 32] &= ~((uint32_t)1 << ('\n' % 32));
+		return newset(ps, &s, 1);
+	case '^':
+		addrange(&s, BOL, BOL);
+		return newset(ps, &s, 0);
+	case '$':
+		addrange(&s, EOL, EOL);
+		return newset(ps, &s, 0);
+	case '*': case '+': case '?': case '{':
+		ps->bad = 1;
+		return -1;
+	case '\\':
+		/* Escaped letters and digits are GNU extensions and
+		 * back-references. */
+		c = (unsigned char)*ps->p++;
+		if (c == '\0' || isalnum(c)) {
+			ps->bad = 1;
+			return -1;
+		}
+		break;
+	}
+	addrange(&s, c, c);
+	return newset(ps, &s, 0);
+}
+
+/* Appends the literal bytes node n starts with to re->pre.  Returns 1 if
+ * all of n was literal, so whatever follows it can extend the prefix. */
+static int litprefix(struct re *re, struct parse *ps, int n, int *anchored)
+{
+	struct node *nd = &ps->nodes[n];
+	int c, only = -1, k = 0;
+	switch (nd->type) {
+	case N_EMPTY:
+		return 1;
+	case N_GROUP:
+		return nd->l < 0 || litprefix(re, ps, nd->l, anchored);
+	case N_CAT:
+		return litprefix(re, ps, nd->l, anchored) &&
+		       litprefix(re, ps, nd->r, anchored);
+	case N_SET:
+		if (nd->mb)
+			return 0;
+		for (c = 0; c < NSYM && k < 2; c++)
+			if (inset(&nd->set, c))
+				only = c, k++;
+		if (k != 1)
+			return 0;
+		if (only == BOL && re->npre == 0) {
+			*anchored = 1;
+			return 1;
+		}
+		if (only >= 256 || re->npre == MAXPRE)
+			return 0;
+		re->pre[re->npre++] = only;
+		return 1;
+	}
+	return 0;
+}
+
+static int emit(struct re *re, int op, int x, int y)
+{
+	struct inst *prog;
+	if (re->nprog == MAXPROG)
+		return -1;
+	if (re->nprog == re->alloc) {
+		re->alloc = re->alloc ? re->alloc * 2 : 64;
+		if (!(prog = realloc(re->prog, re->alloc * sizeof(*prog))))
+			return -1;
+		re->prog = prog;
+	}
+	re->prog[re->nprog].op = op;
+	re->prog[re->nprog].x = x;
+	re->prog[re->nprog].y = y;
+	return re->nprog++;
+}
+
+static int emitset(struct re *re, struct set *s)
+{
+	struct set *sets, t = *s;
+	/* Read backwards, a line starts where it ended. */
+	if (re->reversed && (inset(s, BOL) || inset(s, EOL))) {
+		t.w[BOL / 32] &= ~((uint32_t)1 << (BOL % 32) |
+		                   (uint32_t)1 << (EOL % 32));
+		if (inset(s, BOL))
+			addrange(&t, EOL, EOL);
+		if (inset(s, EOL))
+			addrange(&t, BOL, BOL);
+	}
+	if (re->nsets == re->salloc) {
+		re->salloc = re->salloc ? re->salloc * 2 : 16;
+		if (!(sets = realloc(re->sets, re->salloc * sizeof(*sets))))
+			return -1;
+		re->sets = sets;
+	}
+	re->sets[re->nsets] = t;
+	return emit(re, I_SET, re->nsets++, 0);
+}
+
+/* Emits the code for node n.  A set that matches non-ASCII characters
+ * takes any valid UTF-8 sequence for one, as libc does in a UTF-8
+ * locale; libc doesn't match invalid bytes at all. */
+static int emitnode(struct re *re, struct parse *ps, int n)
+{
+	static const unsigned char utf8[][4][2] = {
+		{ { 0xc2, 0xdf }, { 0x80, 0xbf } },
+		{ { 0xe0, 0xe0 }, { 0xa0, 0xbf }, { 0x80, 0xbf } },
+		{ { 0xe1, 0xec }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+		{ { 0xed, 0xed }, { 0x80, 0x9f }, { 0x80, 0xbf } },
+		{ { 0xee, 0xef }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+		{ { 0xf0, 0xf0 }, { 0x90, 0xbf }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+		{ { 0xf1, 0xf3 }, { 0x80, 0xbf }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+		{ { 0xf4, 0xf4 }, { 0x80, 0x8f }, { 0x80, 0xbf }, { 0x80, 0xbf } },
+	};
+	enum { NSEQ = sizeof(utf8) / sizeof(utf8[0]) };
+	struct node *nd = &ps->nodes[n];
+	struct set s;
+	int i, j, k, b, split, jmps[NSEQ], loop;
+	switch (nd->type) {
+	case N_EMPTY:
+		return 0;
+	case N_GROUP:
+		/* Only the forward program records where groups are. */
+		if (!re->reversed && emit(re, I_SAVE, 2 * nd->min, 0) < 0)
+			return -1;
+		if (nd->l >= 0 && emitnode(re, ps, nd->l) < 0)
+			return -1;
+		if (!re->reversed && emit(re, I_SAVE, 2 * nd->min + 1, 0) < 0)
+			return -1;
+		return 0;
+	case N_CAT:
+		if (emitnode(re, ps, re->reversed ? nd->r : nd->l) < 0)
+			return -1;
+		return emitnode(re, ps, re->reversed ? nd->l : nd->r);
+	case N_SET:
+		if (!nd->mb)
+			return emitset(re, &nd->set) < 0 ? -1 : 0;
+		/* The set's own bytes, then each kind of UTF-8 sequence. */
+		for (i = 0; i <= NSEQ; i++) {
+			split = i < NSEQ ? emit(re, I_SPLIT, re->nprog + 1, 0) : 0;
+			if (split < 0)
+				return -1;
+			if (i == 0 && emitset(re, &nd->set) < 0)
+				return -1;
+			for (k = 0; i > 0 && k < 4 && utf8[i - 1][k][0]; k++)
+				;
+			for (j = 0; j < k; j++) {
+				b = re->reversed ? k - 1 - j : j;
+				memset(&s, 0, sizeof(s));
+				addrange(&s, utf8[i - 1][b][0],
+				         utf8[i - 1][b][1]);
+				if (emitset(re, &s) < 0)
+					return -1;
+			}
+			if (i < NSEQ) {
+				if ((jmps[i] = emit(re, I_JMP, 0, 0)) < 0)
+					return -1;
+				re->prog[split].y = re->nprog;
+			}
+		}
+		for (i = 0; i < NSEQ; i++)
+			re->prog[jmps[i]].x = re->nprog;
+		return 0;
+	case N_ALT:
+		if ((split = emit(re, I_SPLIT, re->nprog + 1, 0)) < 0 ||
+		    emitnode(re, ps, nd->l) < 0 ||
+		    (jmps[0] = emit(re, I_JMP, 0, 0)) < 0)
+			return -1;
+		re->prog[split].y = re->nprog;
+		if (emitnode(re, ps, nd->r) < 0)
+			return -1;
+		re->prog[jmps[0]].x = re->nprog;
+		return 0;
+	case N_REP:
+		for (i = 0; i < nd->min; i++)
+			if (emitnode(re, ps, nd->l) < 0)
+				return -1;
+		if (nd->max < 0) {
+			loop = re->nprog;
+			if ((split = emit(re, I_SPLIT, loop + 1, 0)) < 0 ||
+			    emitnode(re, ps, nd->l) < 0 ||
+			    emit(re, I_JMP, loop, 0) < 0)
+				return -1;
+			re->prog[split].y = re->nprog;
+			return 0;
+		}
+		/* Each optional copy can stop the repeat early: the splits
+		 * are chained through y and all patched to the end. */
+		loop = -1;
+		for (i = nd->min; i < nd->max; i++) {
+			if ((split = emit(re, I_SPLIT, re->nprog + 1, loop)) < 0 ||
+			    emitnode(re, ps, nd->l) < 0)
+				return -1;
+			loop = split;
+		}
+		while (loop >= 0) {
+			split = re->prog[loop].y;
+			re->prog[loop].y = re->nprog;
+			loop = split;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/* Builds the program for pattern.  Returns -1 if it isn't a pattern
+ * this engine takes. */
+static int compile(struct re *re, char *pattern)
+{
+	struct parse ps = { .p = pattern };
+	int root, anchored = 0, err = -1;
+	char *c;
+	for (c = pattern; *c; c++)
+		if ((unsigned char)*c >= 0x80)
+			return -1;
+	root = parsealt(&ps);
+	if (ps.bad || *ps.p != '\0')
+		goto out;
+	re->ngroups = ps.ngroups;
+	re->literal = litprefix(re, &ps, root, &anchored) && !anchored;
+	if (emitnode(re, &ps, root) < 0 || emit(re, I_MATCH, 0, 0) < 0)
+		goto out;
+	err = 0;
+out:
+	free(ps.nodes);
+	return err;
+}
+
+static int uselibc(struct re *re, char *pattern, char *err, int errsz)
+{
+	int e;
+	re->libc = 1;
+	if ((e = regcomp(&re->reg, pattern, REG_EXTENDED))) {
+		regerror(e, &re->reg, err, errsz);
+		re->libc = 0;
+		return -1;
+	}
+	return 0;
+}
+
+struct re *recomp(char *pattern, char *err, int errsz)
+{
+	struct re *re;
+	if (!(re = calloc(1, sizeof(*re)))) {
+		snprintf(err, errsz, "memory");
+		return NULL;
+	}
+	if (compile(re, pattern) < 0) {
+		free(re->prog);
+		free(re->sets);
+		re->prog = NULL;
+		re->sets = NULL;
+		re->nprog = re->npre = re->literal = 0;
+		if (uselibc(re, pattern, err, errsz) < 0) {
+			free(re);
+			return NULL;
+		}
+		return re;
+	}
+	if (prepare(re) < 0 || !(re->pattern = strdup(pattern))) {
+		refree(re);
+		snprintf(err, errsz, "memory");
+		return NULL;
+	}
+	return re;
+}
+
+/* Allocates what running the DFA needs. */
+static int prepare(struct re *re)
+{
+	re->statesz = sizeof(struct dstate) + re->nprog * sizeof(int);
+	re->statesz = (re->statesz + 7) & ~(size_t)7;
+	re->mark = calloc(re->nprog, sizeof(int));
+	re->list = malloc(re->nprog * sizeof(int));
+	re->stack = malloc(re->nprog * sizeof(int));
+	re->tab = calloc(TABSZ, sizeof(*re->tab));
+	re->pool = malloc(POOLSZ);
+	if (!re->mark || !re->list || !re->stack || !re->tab || !re->pool)
+		return -1;
+	return 0;
+}
+
+/* Compiles pattern, which recomp has already taken, reversed or else
+ * anchored, for renext. */
+static struct re *machine(char *pattern, int reversed)
+{
+	struct re *re;
+	if (!(re = calloc(1, sizeof(*re))))
+		return NULL;
+	re->reversed = reversed;
+	re->anchored = !reversed;
+	if (compile(re, pattern) < 0 || prepare(re) < 0) {
+		refree(re);
+		return NULL;
+	}
+	return re;
+}
+
+void refree(struct re *re)
+{
+	if (!re)
+		return;
+	if (re->libc)
+		regfree(&re->reg);
+	free(re->prog);
+	free(re->sets);
+	free(re->mark);
+	free(re->list);
+	free(re->stack);
+	free(re->tab);
+	free(re->pool);
+	free(re->pattern);
+	refree(re->back);
+	refree(re->from);
+	free(re->starts);
+	free(re->caps);
+	free(re);
+}
+
+/*
+ * Adds the instructions reachable from pc without reading anything to
+ * re->list, skipping those already marked in this generation.  `at`
+ * says whether the position is the start (AT_BOL) or end (AT_EOL) of
+ * the line.  Elsewhere, a thread at ^ dies and one at $ waits for EOL.
+ */
+static void addthread(struct re *re, int pc, int at, int *n)
+{
+	struct inst *in;
+	int sp = 0;
+	re->stack[sp++] = pc;
+	while (sp > 0) {
+		pc = re->stack[--sp];
+		if (re->mark[pc] == re->gen)
+			continue;
+		re->mark[pc] = re->gen;
+		in = &re->prog[pc];
+		if (in->op == I_JMP)
+			re->stack[sp++] = in->x;
+		else if (in->op == I_SPLIT) {
+			re->stack[sp++] = in->y;
+			re->stack[sp++] = in->x;
+		} else if (in->op == I_SAVE) {
+			re->stack[sp++] = pc + 1;
+		} else if (in->op == I_SET && inset(&re->sets[in->x], BOL)) {
+			if (at & AT_BOL)
+				re->stack[sp++] = pc + 1;
+		} else if (in->op == I_SET && (at & AT_EOL) &&
+		           inset(&re->sets[in->x], EOL)) {
+			re->stack[sp++] = pc + 1;
+		} else {
+			re->list[(*n)++] = pc;
+		}
+	}
+}
+
+static int cmpint(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+/* Drops every cached state, to make room. */
+static void flush(struct re *re)
+{
+	memset(re->tab, 0, TABSZ * sizeof(*re->tab));
+	re->poolused = 0;
+	re->nstates = 0;
+	re->start = NULL;
+	re->mid = NULL;
+	re->flushes++;
+}
+
+/* Finds or makes the state for the sorted instructions pcs.  This may
+ * flush the cache, so no other state pointer survives the call. */
+static struct dstate *getstate(struct re *re, int *pcs, int n, int bol)
+{
+	uint32_t h = 2166136261u ^ bol;
+	struct dstate *s;
+	int i;
+	for (i = 0; i < n; i++)
+		h = (h ^ pcs[i]) * 16777619u;
+	for (i = h % TABSZ; (s = re->tab[i]); i = (i + 1) % TABSZ)
+		if (s->n == n && s->bol == bol &&
+		    memcmp(s->pcs, pcs, n * sizeof(int)) == 0)
+			return s;
+	if (re->nstates >= TABSZ / 2 || re->poolused + re->statesz > POOLSZ)
+		flush(re);
+	s = (struct dstate *)(re->pool + re->poolused);
+	re->poolused += (sizeof(*s) + n * sizeof(int) + 7) & ~(size_t)7;
+	memset(s->next, 0, sizeof(s->next));
+	s->n = n;
+	s->bol = bol;
+	s->match = 0;
+	memcpy(s->pcs, pcs, n * sizeof(int));
+	for (i = 0; i < n; i++)
+		if (re->prog[pcs[i]].op == I_MATCH)
+			s->match = 1;
+	for (i = h % TABSZ; re->tab[i]; i = (i + 1) % TABSZ)
+		;
+	re->tab[i] = s;
+	re->nstates++;
+	return s;
+}
+
+static struct dstate *startstate(struct re *re)
+{
+	int n = 0;
+	if (!re->start) {
+		re->gen++;
+		addthread(re, 0, AT_BOL, &n);
+		qsort(re->list, n, sizeof(int), cmpint);
+		re->start = getstate(re, re->list, n, 1);
+	}
+	return re->start;
+}
+
+/* Works out where s goes on c and caches the answer in s. */
+static struct dstate *step(struct re *re, struct dstate *s, int c)
+{
+	struct dstate *t;
+	int i, n = 0, flushes = re->flushes, at = 0;
+	/* An empty line starts where it ends. */
+	if (c == EOL)
+		at = AT_EOL | (s->bol ? AT_BOL : 0);
+	re->gen++;
+	for (i = 0; i < s->n; i++) {
+		struct inst *in = &re->prog[s->pcs[i]];
+		if (in->op == I_SET && inset(&re->sets[in->x], c))
+			addthread(re, s->pcs[i] + 1, at, &n);
+	}
+	/* A match can start anywhere in the line, unless it's anchored. */
+	if (!re->anchored)
+		addthread(re, 0, at, &n);
+	qsort(re->list, n, sizeof(int), cmpint);
+	t = getstate(re, re->list, n, 0);
+	/* Unless that flushed the cache, and s with it. */
+	if (re->flushes == flushes)
+		s->next[c] = t;
+	return t;
+}
+
+/* The state an anchored match starts in away from the line's start. */
+static struct dstate *midstate(struct re *re)
+{
+	int n = 0;
+	if (!re->mid) {
+		re->gen++;
+		addthread(re, 0, 0, &n);
+		qsort(re->list, n, sizeof(int), cmpint);
+		re->mid = getstate(re, re->list, n, 0);
+	}
+	return re->mid;
+}
+
+static int dfamatch(struct re *re, char *p, char *e)
+{
+	struct dstate *s = startstate(re), *t;
+	/* With no threads left (past the ^ of an anchored pattern, say)
+	 * nothing can match later in the line. */
+	for (; !s->match && s->n && p < e; p++) {
+		t = s->next[(unsigned char)*p];
+		s = t ? t : step(re, s, (unsigned char)*p);
+	}
+	if (!s->match && s->n)
+		s = (t = s->next[EOL]) ? t : step(re, s, EOL);
+	return s->match;
+}
+
+static int libcmatch(struct re *re, char *p, char *e)
+{
+#ifdef REG_STARTEND
+	/* Match the line in place; the buffer may be read-only. */
+	regmatch_t m = { .rm_so = 0, .rm_eo = e - p };
+	return regexec(&re->reg, p, 1, &m, REG_STARTEND) == 0;
+#else
+	char c = *e;
+	int err;
+	*e = '\0';
+	err = regexec(&re->reg, p, 0, NULL, 0);
+	*e = c;
+	return err == 0;
+#endif
+}
+
+int rematch(struct re *re, char *p, char *e)
+{
+	if (re->libc)
+		return libcmatch(re, p, e);
+	if (re->literal)
+		return memmem(p, e - p, re->pre, re->npre) != NULL;
+	return dfamatch(re, p, e);
+}
+
+char *refind(struct re *re, char *p, char *end)
+{
+	char *e, *q;
+	while (p < end) {
+		if (re->npre) {
+			if (!(q = memmem(p, end - p, re->pre, re->npre)))
+				return NULL;
+			while (q > p && q[-1] != '\n')
+				q--;
+			p = q;
+		}
+		if (!(e = memchr(p, '\n', end - p)))
+			e = end;
+		if (re->literal && re->npre)
+			return p;
+		if (re->libc ? libcmatch(re, p, e) : dfamatch(re, p, e))
+			return p;
+		p = e + 1;
+	}
+	return NULL;
+}
+
+/*
+ * Sets a bit in re->starts for each place in the line [ls, e] where a
+ * match can start, re being the program reversed: read from e back to
+ * ls, it has matched wherever a match starts.
+ */
+static int scanstarts(struct re *re, char *ls, char *e)
+{
+	struct dstate *s = startstate(re), *t;
+	size_t need = (e - ls) / 8 + 1;
+	unsigned char *b;
+	char *p;
+	if (need > re->nstarts) {
+		if (!(b = realloc(re->starts, need)))
+			return -1;
+		re->starts = b;
+		re->nstarts = need;
+	}
+	memset(re->starts, 0, need);
+	re->sls = ls;
+	re->se = e;
+	for (p = e; ; p--) {
+		if (s->match)
+			re->starts[(p - ls) / 8] |= 1 << (p - ls) % 8;
+		if (p == ls)
+			break;
+		t = s->next[(unsigned char)p[-1]];
+		s = t ? t : step(re, s, (unsigned char)p[-1]);
+	}
+	/* Matches after a ^ only show once the line's start is read. */
+	s = (t = s->next[EOL]) ? t : step(re, s, EOL);
+	if (s->match)
+		re->starts[0] |= 1;
+	return 0;
+}
+
+/* Returns the end of the longest match starting at s in the line
+ * [ls, e), re being the program anchored, or NULL if there's none.
+ * This reads on until no longer match is possible, which may be well
+ * past the end of the one it finds. */
+static char *longest(struct re *re, char *ls, char *s, char *e)
+{
+	struct dstate *d = s == ls ? startstate(re) : midstate(re), *t;
+	char *p, *end = d->match ? s : NULL;
+	for (p = s; d->n && p < e; p++) {
+		t = d->next[(unsigned char)*p];
+		d = t ? t : step(re, d, (unsigned char)*p);
+		if (d->match)
+			end = p + 1;
+	}
+	if (d->n && p == e) {
+		d = (t = d->next[EOL]) ? t : step(re, d, EOL);
+		if (d->match)
+			end = e;
+	}
+	return end;
+}
+
+/*
+ * Adds the thread at pc, with the positions in cap, to pcs and caps,
+ * first following whatever doesn't read anything.  Like addthread, but
+ * depth first, so that threads go in in order of preference, and
+ * recording positions as it passes the I_SAVEs of groups.
+ */
+static void vmadd(struct re *re, int *pcs, long *caps, int *n, int pc,
+                  long *cap, long pos, int at, int ncap)
+{
+	struct inst *in;
+	long was;
+	if (re->mark[pc] == re->gen)
+		return;
+	re->mark[pc] = re->gen;
+	in = &re->prog[pc];
+	switch (in->op) {
+	case I_JMP:
+		vmadd(re, pcs, caps, n, in->x, cap, pos, at, ncap);
+		return;
+	case I_SPLIT:
+		vmadd(re, pcs, caps, n, in->x, cap, pos, at, ncap);
+		vmadd(re, pcs, caps, n, in->y, cap, pos, at, ncap);
+		return;
+	case I_SAVE:
+		if (in->x >= ncap) {
+			vmadd(re, pcs, caps, n, pc + 1, cap, pos, at, ncap);
+			return;
+		}
+		was = cap[in->x];
+		cap[in->x] = pos;
+		vmadd(re, pcs, caps, n, pc + 1, cap, pos, at, ncap);
+		cap[in->x] = was;
+		return;
+	case I_SET:
+		if (inset(&re->sets[in->x], BOL)) {
+			if (at & AT_BOL)
+				vmadd(re, pcs, caps, n, pc + 1, cap, pos, at,
+				      ncap);
+			return;
+		}
+		if (inset(&re->sets[in->x], EOL)) {
+			if (at & AT_EOL)
+				vmadd(re, pcs, caps, n, pc + 1, cap, pos, at,
+				      ncap);
+			return;
+		}
+		break;
+	}
+	pcs[*n] = pc;
+	memcpy(caps + *n * ncap, cap, ncap * sizeof(*cap));
+	(*n)++;
+}
+
+/*
+ * Fills in m[1] to m[nsub - 1] for the match [s, end) of the line
+ * [ls, e), running re's program over just the match as an NFA, with a
+ * thread for each instruction.  Threads are kept in order of preference
+ * (the first alternative, and another pass of a repeat, first) and the
+ * first to reach the match's end wins, so the groups come out as a
+ * backtracking matcher would find them for that match.  This takes time
+ * for the program's size at each byte, which is why only replace, and
+ * only with \1 to \9, asks for it.
+ */
+static int groups(struct re *re, char *ls, char *s, char *end, char *e,
+                  struct resub *m, int nsub)
+{
+	int ncap = 2 * nsub, *cpcs = re->list, *npcs = re->stack, *tp;
+	int nc = 0, nn, i, at;
+	long *ccaps, *ncaps, *cap, *tc;
+	struct inst *in;
+	char *q;
+	if (ncap > re->ncap) {
+		if (!(tc = realloc(re->caps, (2 * re->nprog + 1) * ncap *
+		                              sizeof(*tc))))
+			return -1;
+		re->caps = tc;
+		re->ncap = ncap;
+	}
+	ccaps = re->caps;
+	ncaps = ccaps + re->nprog * ncap;
+	cap = ncaps + re->nprog * ncap;
+	for (i = 0; i < ncap; i++)
+		cap[i] = -1;
+	at = (s == ls ? AT_BOL : 0) | (s == e ? AT_EOL : 0);
+	re->gen++;
+	vmadd(re, cpcs, ccaps, &nc, 0, cap, s - ls, at, ncap);
+	for (q = s; q < end; q++) {
+		at = q + 1 == e ? AT_EOL : 0;
+		re->gen++;
+		nn = 0;
+		for (i = 0; i < nc; i++) {
+			in = &re->prog[cpcs[i]];
+			if (in->op == I_SET &&
+			    inset(&re->sets[in->x], (unsigned char)*q))
+				vmadd(re, npcs, ncaps, &nn, cpcs[i] + 1,
+				      ccaps + i * ncap, q + 1 - ls, at, ncap);
+		}
+		tp = cpcs, cpcs = npcs, npcs = tp;
+		tc = ccaps, ccaps = ncaps, ncaps = tc;
+		nc = nn;
+	}
+	for (i = 0; i < nc; i++) {
+		if (re->prog[cpcs[i]].op != I_MATCH)
+			continue;
+		cap = ccaps + i * ncap;
+		for (at = 1; at < nsub; at++) {
+			if (cap[2 * at] >= 0 && cap[2 * at + 1] >= 0) {
+				m[at].so = cap[2 * at];
+				m[at].eo = cap[2 * at + 1];
+			}
+		}
+		break;
+	}
+	return 0;
+}
+
+static int libcnext(struct re *re, char *ls, char *p, char *e,
+                    struct resub *m, int nsub)
+{
+	regmatch_t rm[MAXSUB];
+	int err, i;
+#ifdef REG_STARTEND
+	rm[0].rm_so = p - ls;
+	rm[0].rm_eo = e - ls;
+	err = regexec(&re->reg, ls, nsub, rm, REG_STARTEND);
+#else
+	/* End the line with a NUL for regexec.  There's always a byte to
+	 * spare past the end of the buffer. */
+	char c = *e;
+	*e = '\0';
+	err = regexec(&re->reg, p, nsub, rm, p > ls ? REG_NOTBOL : 0);
+	*e = c;
+	for (i = 0; !err && i < nsub; i++) {
+		if (rm[i].rm_so >= 0) {
+			rm[i].rm_so += p - ls;
+			rm[i].rm_eo += p - ls;
+		}
+	}
+#endif
+	if (err == REG_NOMATCH)
+		return 0;
+	if (err)
+		return -1;
+	for (i = 0; i < nsub; i++) {
+		m[i].so = rm[i].rm_so;
+		m[i].eo = rm[i].rm_so >= 0 ? rm[i].rm_eo : -1;
+	}
+	return 1;
+}
+
+int renext(struct re *re, char *ls, char *p, char *e, struct resub *m,
+           int nsub)
+{
+	struct re *back;
+	size_t i, n = e - ls;
+	char *s, *end;
+	if (re->libc)
+		return libcnext(re, ls, p, e, m, nsub);
+	for (i = 1; i < (size_t)nsub; i++)
+		m[i].so = m[i].eo = -1;
+	if (re->literal && !re->ngroups) {
+		if (!(s = memmem(p, e - p, re->pre, re->npre)))
+			return 0;
+		end = s + re->npre;
+	} else {
+		if (!re->back && !(re->back = machine(re->pattern, 1)))
+			return -1;
+		if (!re->from && !(re->from = machine(re->pattern, 0)))
+			return -1;
+		back = re->back;
+		if ((p == ls || ls != back->sls || e != back->se) &&
+		    scanstarts(back, ls, e) < 0)
+			return -1;
+		for (i = p - ls; i <= n; i++) {
+			while (i % 8 == 0 && i + 8 <= n && !back->starts[i / 8])
+				i += 8;
+			if (back->starts[i / 8] >> i % 8 & 1)
+				break;
+		}
+		if (i > n || !(end = longest(re->from, ls, ls + i, e)))
+			return 0;
+		s = ls + i;
+		if (nsub > 1 && re->ngroups &&
+		    groups(re, ls, s, end, e, m, nsub) < 0)
+			return -1;
+	}
+	m[0].so = s - ls;
+	m[0].eo = end - ls;
+	return 1;
+}
@@ -0,0 +1,49 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Line matching for search and replace.  recomp compiles an extended
+ * regular expression.  Patterns built from ASCII characters, ., bracket
+ * expressions, ^, $, grouping, | and the *, +, ? and {m,n} repeats run
+ * on lwe's own engine: a Thompson NFA run as a DFA whose states are
+ * built lazily, as the text needs them, in a fixed amount of memory.  A
+ * search is then linear in the text, whatever the pattern.  A pattern
+ * that starts with a literal string jumps between occurrences of it with
+ * memmem.  Everything else (back-references, GNU escapes, non-ASCII
+ * characters) is handed to the C library's regexec.
+ *
+ * Replace is only linear apart from a lookahead: finding where matches
+ * start takes one more pass over each line they're in, but finding
+ * where each ends reads on until no longer match could, which for a
+ * pattern like `ab|a.*c` is the rest of the line every time.
+ */
+
+struct re;
+
+/* Where a match, or a subexpression of one, is in its line, in bytes
+ * from the line's start.  Both are -1 if it had no part in the match. */
+struct resub {
+	long so, eo;
+};
+
+/* Returns NULL on failure, with a message for the user in err. */
+struct re *recomp(char *pattern, char *err, int errsz);
+void refree(struct re *re);
+
+/* Returns whether the line [p, e), which doesn't include its newline,
+ * contains a match. */
+int rematch(struct re *re, char *p, char *e);
+
+/* Returns the start of the first line in [p, end) that contains a
+ * match, or NULL if none does.  p must be the start of a line. */
+char *refind(struct re *re, char *p, char *end);
+
+/*
+ * Finds the leftmost longest match in [p, e), part of the line starting
+ * at ls, and puts it in m[0] and up to 9 of its subexpressions in m[1]
+ * to m[nsub - 1].  Asking for just m[0] is quicker.  Calls for a line
+ * should go from its start to its end: one at ls reads the line afresh
+ * and the rest use what it found.  Returns 1 if there was a match, 0 if
+ * not and -1 if there was no memory to look.
+ */
+int renext(struct re *re, char *ls, char *p, char *e, struct resub *m,
+           int nsub);
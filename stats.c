@@ -0,0 +1,92 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+struct stats stats;
+
+static char *human(char *buf, int sz, unsigned long long n);
+static unsigned long long rss(void);
+
+/* Formats a byte count with a binary suffix, e.g. 12K or 3.4G. */
+static char *human(char *buf, int sz, unsigned long long n)
+{
+	static const char units[] = "BKMGT";
+	double v = n;
+	int u = 0;
+	while (v >= 1024 && units[u + 1]) {
+		v /= 1024;
+		u++;
+	}
+	if (u == 0)
+		snprintf(buf, sz, "%lluB", n);
+	else
+		snprintf(buf, sz, v < 10 ? "%.1f%c" : "%.0f%c", v, units[u]);
+	return buf;
+}
+
+/* The resident set now, where /proc says. */
+static unsigned long long rss(void)
+{
+	unsigned long size, res = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &res) != 2)
+			res = 0;
+		fclose(f);
+	}
+	return (unsigned long long)res * sysconf(_SC_PAGESIZE);
+}
+
+void memadd(struct memuse *m, unsigned long long sz)
+{
+	m->now += sz;
+	if (m->now > m->peak)
+		m->peak = m->now;
+}
+
+void memsub(struct memuse *m, unsigned long long sz)
+{
+	m->now -= sz;
+}
+
+void statsline(char *buf, int sz)
+{
+	char a[9][16];
+	snprintf(buf, sz, "moved %s  extends %llu (%s, now %s, released %s)  "
+	         "mapped %s  undo %llu recs %s  yanked %s  bang %s in %s out "
+	         "(%llu/%llu remembered)",
+	         human(a[0], 16, stats.moved), stats.extends,
+	         human(a[1], 16, stats.extended),
+	         human(a[2], 16, stats.allocated.now),
+	         human(a[8], 16, stats.released),
+	         human(a[7], 16, stats.mapped), stats.undosteps,
+	         human(a[3], 16, stats.undobytes.now),
+	         human(a[4], 16, stats.yanked),
+	         human(a[5], 16, stats.bangin), human(a[6], 16, stats.bangout),
+	         stats.memohits, stats.memohits + stats.memomisses);
+}
+
+void memline(char *buf, int sz)
+{
+	char a[11][16];
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	snprintf(buf, sz, "now/peak: buffers %s/%s (%llu shrinks)  "
+	         "undo %s/%s (%s on disk)  yanks %s/%s  bang %s/%s  "
+	         "resident %s/%s",
+	         human(a[0], 16, stats.allocated.now),
+	         human(a[1], 16, stats.allocated.peak), stats.shrinks,
+	         human(a[2], 16, stats.undobytes.now),
+	         human(a[3], 16, stats.undobytes.peak),
+	         human(a[8], 16, stats.undodisk),
+	         human(a[4], 16, stats.yankbytes.now),
+	         human(a[5], 16, stats.yankbytes.peak),
+	         human(a[9], 16, stats.memobytes.now),
+	         human(a[10], 16, stats.memobytes.peak),
+	         human(a[6], 16, rss()),
+	         human(a[7], 16, (unsigned long long)ru.ru_maxrss * 1024));
+}
@@ -0,0 +1,42 @@
+/* (C) 2015 Tom Wright */
+
+/* Memory held by one part of the editor, now and at its most. */
+struct memuse {
+	unsigned long long now, peak;
+};
+
+/*
+ * Running counters for the buffer engine, shown by the `=` command.
+ * Modules bump the fields directly (memory through memadd and memsub);
+ * they're plain integers, so keeping them costs next to nothing.
+ */
+
+struct stats {
+	unsigned long long moved;	/* bytes memmoved by bufinsert/bufdelete */
+	unsigned long long extends;	/* times a buffer's mapping grew */
+	unsigned long long extended;	/* bytes allocated by those */
+	unsigned long long shrinks;	/* times one shrank */
+	struct memuse allocated;	/* buffer allocations */
+	unsigned long long released;	/* emptied pages given back */
+	unsigned long long mapped;	/* files mapped by read-only buffers */
+	unsigned long long undosteps;	/* undo / redo records made */
+	struct memuse undobytes;	/* deleted text undo holds in memory */
+	unsigned long long undodisk;	/* and in its spill file */
+	unsigned long long yanked;	/* bytes stored in the yank ring */
+	struct memuse yankbytes;	/* yank ring text held in memory */
+	unsigned long long bangin;	/* bytes piped to shell commands */
+	unsigned long long bangout;	/* bytes read back from them */
+	unsigned long long memohits;	/* commands answered from bangmemo */
+	unsigned long long memomisses;	/* and run */
+	struct memuse memobytes;	/* runs bangmemo keeps */
+};
+
+extern struct stats stats;
+
+void memadd(struct memuse *m, unsigned long long sz);
+void memsub(struct memuse *m, unsigned long long sz);
+
+/* Format the counters, or memory use (each part's, and the process's
+ * resident set), into one line of at most sz bytes. */
+void statsline(char *buf, int sz);
+void memline(char *buf, int sz);
@@ -0,0 +1,384 @@
+/* (C) 2015 Tom Wright */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include "buffer.h"
+#include "err.h"
+#include "stream.h"
+
+#define CHUNKSZ 65536
+/* Without inotify, how often a followed file is checked, in seconds. */
+#define FOLLOWPOLL 1
+
+/* The reader thread fills `pending`; streamdrain swaps it out under the
+ * lock and appends it, so neither side copies while holding the lock. */
+struct stream {
+	struct buffer *b;
+	char *path;
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	char *pending;
+	size_t npending, allocated;
+	size_t loaded;
+	int follow;	/* keep reading as the file grows */
+	off_t from;	/* where a followed file starts to be read */
+	int done, failed;
+	struct stream *next;
+};
+
+static struct stream *streams;
+
+static void *reader(void *arg);
+static int stage(struct stream *s, char *data, size_t sz);
+static int watch(struct stream *s);
+static int watchdir(char *path);
+static int openfollowed(struct stream *s);
+static int waitgrowth(int wd);
+static int rotated(struct stream *s, int *wd);
+static int start(struct stream *s, struct buffer *b, char *path);
+
+int streamable(char *path)
+{
+	struct stat st;
+	if (strcmp(path, "-") == 0)
+		return 1;
+	return stat(path, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+/* Adds sz bytes to the data waiting to be drained.  Called with the
+ * lock held. */
+static int stage(struct stream *s, char *data, size_t sz)
+{
+	if (s->npending + sz > s->allocated) {
+		size_t n = s->allocated ? s->allocated : CHUNKSZ;
+		while (n < s->npending + sz)
+			n *= 2;
+		char *p = realloc(s->pending, n);
+		if (p == NULL)
+			return -1;
+		s->pending = p;
+		s->allocated = n;
+	}
+	memcpy(s->pending + s->npending, data, sz);
+	s->npending += sz;
+	return 0;
+}
+
+/* Sets up a watch on a followed file.  Returns the watch descriptor,
+ * or -1 on failure; without inotify there's nothing to set up. */
+static int watch(struct stream *s)
+{
+#ifdef __linux__
+	int wd = inotify_init1(IN_CLOEXEC);
+	if (wd < 0)
+		return -1;
+	/* Moves, unlinks and truncations too, to see logs rotated. */
+	if (inotify_add_watch(wd, s->path, IN_MODIFY | IN_ATTRIB |
+	                      IN_MOVE_SELF | IN_DELETE_SELF) < 0) {
+		close(wd);
+		return -1;
+	}
+	return wd;
+#else
+	(void)s;
+	return 0;
+#endif
+}
+
+/* Sets up a watch for files created in the directory `path` is in, for
+ * openfollowed.  Returns the watch descriptor, or -1 on failure. */
+static int watchdir(char *path)
+{
+#ifdef __linux__
+	char *dir, *slash;
+	int wd = inotify_init1(IN_CLOEXEC);
+	if (wd < 0)
+		return -1;
+	if (!(dir = strdup(path))) {
+		close(wd);
+		return -1;
+	}
+	if (!(slash = strrchr(dir, '/')))
+		strcpy(dir, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+	if (inotify_add_watch(wd, dir, IN_CREATE | IN_MOVED_TO) < 0) {
+		close(wd);
+		wd = -1;
+	}
+	free(dir);
+	return wd;
+#else
+	(void)path;
+	return 0;
+#endif
+}
+
+/* Opens a followed file, first waiting for it to be created if it
+ * doesn't exist yet, as tail -F does.  Returns the file descriptor, or
+ * -1 on failure. */
+static int openfollowed(struct stream *s)
+{
+	int fd, wd = -1;
+	while ((fd = open(s->path, O_RDONLY)) < 0 && errno == ENOENT) {
+		/* Look again once watching, so a file created in between
+		 * isn't missed. */
+		if (wd < 0) {
+			if ((wd = watchdir(s->path)) < 0)
+				break;
+		} else if (waitgrowth(wd) < 0) {
+			break;
+		}
+	}
+#ifdef __linux__
+	if (wd >= 0)
+		close(wd);
+#endif
+	return fd;
+}
+
+/* Blocks until a followed file may have grown, or for openfollowed, a
+ * file may have been created.  Returns 0, or -1 if the watch failed. */
+static int waitgrowth(int wd)
+{
+#ifdef __linux__
+	char ev[sizeof(struct inotify_event) + 256];
+	while (read(wd, ev, sizeof(ev)) < 0) {
+		if (errno != EINTR)
+			return -1;
+	}
+#else
+	(void)wd;
+	sleep(FOLLOWPOLL);
+#endif
+	return 0;
+}
+
+/*
+ * Catches up when a followed file has been rotated, as tail -F does: a
+ * file truncated is read again from its start, and one moved or deleted
+ * is reopened by name once the rest of it has been read, waiting for it
+ * to be created if need be.  Called at the end of the file.  Returns 1
+ * if there may be more to read now, 0 if not and -1 on failure.
+ */
+static int rotated(struct stream *s, int *wd)
+{
+	struct stat now, st;
+	off_t pos;
+	if (fstat(s->fd, &now) < 0 ||
+	    (pos = lseek(s->fd, 0, SEEK_CUR)) < 0)
+		return -1;
+	if (now.st_size > pos)
+		return 1;
+	if (stat(s->path, &st) == 0 && st.st_dev == now.st_dev &&
+	    st.st_ino == now.st_ino) {
+		if (now.st_size == pos)
+			return 0;
+		return lseek(s->fd, 0, SEEK_SET) < 0 ? -1 : 1;
+	}
+	close(s->fd);
+#ifdef __linux__
+	close(*wd);
+#endif
+	*wd = -1;
+	if ((s->fd = openfollowed(s)) < 0)
+		return -1;
+	return (*wd = watch(s)) < 0 ? -1 : 1;
+}
+
+static void *reader(void *arg)
+{
+	struct stream *s = arg;
+	char chunk[CHUNKSZ];
+	ssize_t n;
+	int failed = 0, wd = -1, r;
+	/* Opening a FIFO waits for a writer, and a followed file may not
+	 * exist yet, so it's done here too. */
+	if (s->fd < 0)
+		s->fd = s->follow ? openfollowed(s) : open(s->path, O_RDONLY);
+	if (s->fd >= 0 && s->follow) {
+		/* Watch before seeking, so no write can slip in between. */
+		if ((wd = watch(s)) < 0 || lseek(s->fd, s->from, SEEK_SET) < 0) {
+			close(s->fd);
+			s->fd = -1;
+		}
+	}
+	if (s->fd < 0) {
+		pthread_mutex_lock(&s->lock);
+		s->done = s->failed = 1;
+		pthread_mutex_unlock(&s->lock);
+		return NULL;
+	}
+	for (;;) {
+		n = read(s->fd, chunk, sizeof(chunk));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0 && s->follow) {
+			if ((r = rotated(s, &wd)) < 0 ||
+			    (r == 0 && waitgrowth(wd) < 0)) {
+				failed = 1;
+				break;
+			}
+			continue;
+		}
+		if (n <= 0) {
+			failed = n < 0;
+			break;
+		}
+		pthread_mutex_lock(&s->lock);
+		failed = stage(s, chunk, n) < 0;
+		pthread_mutex_unlock(&s->lock);
+		if (failed)
+			break;
+	}
+	if (s->fd != STDIN_FILENO)
+		close(s->fd);
+#ifdef __linux__
+	if (wd >= 0)
+		close(wd);
+#endif
+	pthread_mutex_lock(&s->lock);
+	s->done = 1;
+	s->failed = failed;
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+int streamopen(struct buffer *b, char *path)
+{
+	struct stream *s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		seterr("memory");
+		return -1;
+	}
+	s->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : -1;
+	return start(s, b, path);
+}
+
+int streamfollow(struct buffer *b, char *path, size_t from)
+{
+	struct stream *s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		seterr("memory");
+		return -1;
+	}
+	s->fd = -1;
+	s->follow = 1;
+	s->from = from;
+	return start(s, b, path);
+}
+
+/* Starts the reader thread for a new stream. */
+static int start(struct stream *s, struct buffer *b, char *path)
+{
+	s->b = b;
+	s->path = path;
+	pthread_mutex_init(&s->lock, NULL);
+	if (pthread_create(&s->thread, NULL, reader, s) != 0) {
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		seterr("can't start reader");
+		return -1;
+	}
+	s->next = streams;
+	streams = s;
+	return 0;
+}
+
+int streaming(void)
+{
+	struct stream *s;
+	int active = 0;
+	for (s = streams; s && !active; s = s->next) {
+		pthread_mutex_lock(&s->lock);
+		active = !s->done || s->npending > 0;
+		pthread_mutex_unlock(&s->lock);
+	}
+	return active;
+}
+
+int streamdrain(void)
+{
+	struct stream *s, **p;
+	char *data, msg[256];
+	size_t sz, allocated;
+	int done, failed, grew = 0;
+	for (p = &streams; (s = *p); ) {
+		pthread_mutex_lock(&s->lock);
+		data = s->pending;
+		sz = s->npending;
+		allocated = s->allocated;
+		s->pending = NULL;
+		s->npending = s->allocated = 0;
+		done = s->done;
+		failed = s->failed;
+		pthread_mutex_unlock(&s->lock);
+		if (sz > 0) {
+			if (bufappend(s->b, data, sz) < 0) {
+				free(data);
+				return -1;
+			}
+			s->loaded += sz;
+			grew |= s->b == bufcurrent();
+		}
+		/* Hand the staging area back rather than growing a new one. */
+		pthread_mutex_lock(&s->lock);
+		if (s->pending == NULL) {
+			s->pending = data;
+			s->allocated = allocated;
+			data = NULL;
+		}
+		pthread_mutex_unlock(&s->lock);
+		free(data);
+		if (done && sz == 0) {
+			pthread_join(s->thread, NULL);
+			pthread_mutex_destroy(&s->lock);
+			free(s->pending);
+			*p = s->next;
+			if (failed) {
+				snprintf(msg, sizeof(msg), "can't read %s", s->path);
+				seterr(msg);
+			}
+			free(s);
+			if (failed)
+				return -1;
+			continue;
+		}
+		p = &s->next;
+	}
+	return grew;
+}
+
+int streamloading(struct buffer *b, size_t *loaded)
+{
+	struct stream *s;
+	for (s = streams; s; s = s->next) {
+		if (s->b == b && !s->follow) {
+			*loaded = s->loaded;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int streamfollowing(struct buffer *b)
+{
+	struct stream *s;
+	for (s = streams; s; s = s->next)
+		if (s->b == b && s->follow)
+			return 1;
+	return 0;
+}
@@ -0,0 +1,42 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+struct buffer;
+
+/*
+ * Files that can't be read up front -- standard input (named "-") and
+ * FIFOs -- are streamed: a thread reads them in the background, and the
+ * data is appended to the end of their buffer whenever streamdrain is
+ * called.  Regular files can also be followed as they grow.  Only the
+ * command loop drains, so a command in progress never sees the buffer
+ * move under it.
+ */
+
+/* Returns true if `path` has to be streamed. */
+int streamable(char *path);
+
+/* Starts streaming `path` into `b`, which should be empty.  Returns 0 on
+ * success and -1 on failure. */
+int streamopen(struct buffer *b, char *path);
+
+/* Follows `path` like tail -f: the bytes appended to it from offset
+ * `from` on are streamed into `b`.  If `path` doesn't exist yet, it's
+ * read from the start once it's created.  Returns 0 on success and -1
+ * on failure. */
+int streamfollow(struct buffer *b, char *path, size_t from);
+
+/* Returns true while any stream has data still to come. */
+int streaming(void);
+
+/* Appends whatever has been read so far to the streamed buffers.
+ * Returns 1 if the current buffer grew, 0 if not and -1 on failure.  A
+ * stream that failed is stopped, and its buffer kept as it is. */
+int streamdrain(void);
+
+/* Returns true while `b` is still loading, with the number of bytes
+ * loaded so far in *loaded. */
+int streamloading(struct buffer *b, size_t *loaded);
+
+/* Returns true if `b` is being followed. */
+int streamfollowing(struct buffer *b);
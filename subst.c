@@ -0,0 +1,170 @@
+/* (C) 2015 Tom Wright */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "err.h"
+#include "re.h"
+#include "subst.h"
+
+/* The whole match and \1 to \9. */
+#define NSUB 10
+/* Matches closer than this share a hunk: copying the bytes between them
+ * costs less than undo's record of another. */
+#define MERGEGAP 128
+
+static int usesgroups(char *repl);
+static int emit(struct subst_output *o, size_t *alloc, char *p, size_t sz);
+static int expand(struct subst_output *o, size_t *alloc, char *repl,
+                  char *ls, struct resub *m);
+static int addhunk(struct subst_output *o, long *alloc, size_t a, size_t b);
+static void endhunk(struct subst_output *o, size_t a);
+static char *nextchar(char *p, char *e);
+
+/* Returns whether repl has any of \1 to \9, needing renext to find the
+ * subexpressions. */
+static int usesgroups(char *repl)
+{
+	for (; *repl; repl++) {
+		if (*repl == '\\' && repl[1] >= '1' && repl[1] <= '9')
+			return 1;
+		if (*repl == '\\' && repl[1])
+			repl++;
+	}
+	return 0;
+}
+
+/* Appends sz bytes at p to the output. */
+static int emit(struct subst_output *o, size_t *alloc, char *p, size_t sz)
+{
+	size_t newalloc;
+	char *buf;
+	if (o->sz + sz > *alloc) {
+		for (newalloc = *alloc ? *alloc : 4096; newalloc < o->sz + sz;)
+			newalloc *= 2;
+		if (!(buf = realloc(o->buf, newalloc))) {
+			seterr("memory");
+			return -1;
+		}
+		o->buf = buf;
+		*alloc = newalloc;
+	}
+	memcpy(o->buf + o->sz, p, sz);
+	o->sz += sz;
+	return 0;
+}
+
+/* Appends the replacement for the match in m. */
+static int expand(struct subst_output *o, size_t *alloc, char *repl,
+                  char *ls, struct resub *m)
+{
+	char *r, nl = '\n';
+	int i, err = 0;
+	for (r = repl; *r && !err; r++) {
+		if (*r == '&') {
+			err = emit(o, alloc, ls + m[0].so, m[0].eo - m[0].so);
+		} else if (*r == '\\' && r[1] >= '1' && r[1] <= '9') {
+			i = *++r - '0';
+			if (m[i].so >= 0)
+				err = emit(o, alloc, ls + m[i].so,
+				           m[i].eo - m[i].so);
+		} else if (*r == '\\' && r[1] == 'n') {
+			r++;
+			err = emit(o, alloc, &nl, 1);
+		} else {
+			if (*r == '\\' && r[1])
+				r++;
+			err = emit(o, alloc, r, 1);
+		}
+	}
+	return err;
+}
+
+/* Starts a hunk at a in the old text and b in the new. */
+static int addhunk(struct subst_output *o, long *alloc, size_t a, size_t b)
+{
+	struct hunk *h;
+	long newalloc;
+	if (o->nh == *alloc) {
+		newalloc = *alloc ? *alloc * 2 : 64;
+		if (!(h = realloc(o->h, newalloc * sizeof(*h)))) {
+			seterr("memory");
+			return -1;
+		}
+		o->h = h;
+		*alloc = newalloc;
+	}
+	o->h[o->nh].a = a;
+	o->h[o->nh].b = b;
+	o->nh++;
+	return 0;
+}
+
+/* Returns the start of the UTF-8 character after the one at p, where
+ * the search goes on after an empty match. */
+static char *nextchar(char *p, char *e)
+{
+	for (p++; p < e && ((unsigned char)*p & 0xc0) == 0x80; p++)
+		;
+	return p;
+}
+
+/* Ends the last hunk at a in the old text and the end of the new. */
+static void endhunk(struct subst_output *o, size_t a)
+{
+	struct hunk *h = &o->h[o->nh - 1];
+	h->na = a - h->a;
+	h->nb = o->sz - h->b;
+}
+
+int subst(struct subst_output *o, struct re *re, char *repl, char *start,
+          char *end)
+{
+	struct resub m[NSUB];
+	char *ls, *le, *p, *ms, *me, *copied = start, *last = NULL;
+	size_t alloc = 0;
+	long halloc = 0;
+	int nsub = usesgroups(repl) ? NSUB : 1, r;
+	memset(o, 0, sizeof(*o));
+	for (ls = start; (ls = refind(re, ls, end)); ls = le + 1) {
+		if (!(le = memchr(ls, '\n', end - ls)))
+			le = end;
+		for (p = ls; p <= le; p = me > ms ? me : nextchar(ms, le)) {
+			if ((r = renext(re, ls, p, le, m, nsub)) < 0) {
+				seterr("regex ran out of memory");
+				goto fail;
+			}
+			if (r == 0)
+				break;
+			ms = ls + m[0].so;
+			me = ls + m[0].eo;
+			/* An empty match right after another isn't a new one. */
+			if (ms == me && ms == last)
+				continue;
+			if (o->nh > 0 && ms - copied < MERGEGAP) {
+				if (emit(o, &alloc, copied, ms - copied) < 0)
+					goto fail;
+			} else {
+				if (o->nh > 0)
+					endhunk(o, copied - start);
+				if (addhunk(o, &halloc, ms - start, o->sz) < 0)
+					goto fail;
+			}
+			if (expand(o, &alloc, repl, ls, m) < 0)
+				goto fail;
+			o->n++;
+			copied = last = me;
+		}
+		if (le == end)
+			break;
+	}
+	if (o->nh > 0)
+		endhunk(o, copied - start);
+	return 0;
+fail:
+	free(o->buf);
+	free(o->h);
+	memset(o, 0, sizeof(*o));
+	return -1;
+}
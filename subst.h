@@ -0,0 +1,34 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+struct re;
+struct hunk;
+
+/*
+ * The result of a substitution: nh hunks (see diff.h), each running from
+ * the start of a match to the end of the last close enough behind it to
+ * share its hunk, which on most text means a hunk for each line with
+ * matches.  Their old text is counted from the start of the range and
+ * their new text is in buf.  n is how many matches were replaced; when
+ * it's 0 there is no buf and no h.
+ */
+struct subst_output {
+	char *buf;
+	size_t sz;
+	struct hunk *h;
+	long nh;
+	size_t n;
+};
+
+/*
+ * Replaces every match of `re` in [start, end) with `repl`, building the
+ * new text in one pass and leaving the buffer alone.  Matches are found
+ * a line at a time, as sed does: refind picks out the lines that have
+ * any, and renext finds them there.  In `repl`, & is the whole match, \1
+ * to \9 its subexpressions and \n a newline, and a backslash before
+ * anything else stands for that character.  `start` should begin a
+ * line.  Returns 0 on success and -1 (with the error set) on failure.
+ */
+int subst(struct subst_output *o, struct re *re, char *repl, char *start,
+          char *end);
@@ -0,0 +1,78 @@
+/* (C) 2015 Tom Wright */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "err.h"
+#include "text.h"
+
+struct text {
+	unsigned refs;
+	size_t sz;
+	char data[];
+};
+
+/* Freeing a text this big trims the heap, so memory that a big delete
+ * or yank held goes back to the system rather than waiting in malloc's
+ * free lists. */
+#define TRIMSZ (1 << 20)
+
+struct text *textalloc(size_t sz)
+{
+	struct text *t = malloc(sizeof(*t) + sz);
+	if (t == NULL) {
+		seterr("memory");
+		return NULL;
+	}
+	t->refs = 1;
+	t->sz = sz;
+	return t;
+}
+
+struct text *textnew(char *start, char *end)
+{
+	struct text *t;
+	assert(end >= start);
+	if (!(t = textalloc(end - start)))
+		return NULL;
+	memcpy(t->data, start, t->sz);
+	return t;
+}
+
+struct text *textref(struct text *t)
+{
+	assert(t->refs > 0);
+	t->refs++;
+	return t;
+}
+
+void textunref(struct text *t)
+{
+	if (t == NULL)
+		return;
+	assert(t->refs > 0);
+	if (--t->refs > 0)
+		return;
+#ifdef __GLIBC__
+	if (t->sz >= TRIMSZ) {
+		free(t);
+		malloc_trim(0);
+		return;
+	}
+#endif
+	free(t);
+}
+
+char *textdata(struct text *t)
+{
+	return t->data;
+}
+
+size_t textsz(struct text *t)
+{
+	return t->sz;
+}
@@ -0,0 +1,25 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+/*
+ * Immutable, reference counted copies of buffer text.  Text removed
+ * from the buffer is copied once into a struct text, which can then be
+ * shared by the yank ring and the undo list.  Every holder takes its own
+ * reference with textref and drops it with textunref; the copy is freed
+ * along with the last reference.
+ */
+struct text;
+
+/*
+ * textnew copies the range [start, end).  textalloc returns a text of sz
+ * bytes for the caller to fill through textdata before sharing it.  Both
+ * return a text holding one reference, or NULL if out of memory.
+ */
+struct text *textnew(char *start, char *end);
+struct text *textalloc(size_t sz);
+struct text *textref(struct text *t);
+void textunref(struct text *t);
+
+char *textdata(struct text *t);
+size_t textsz(struct text *t);
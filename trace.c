@@ -0,0 +1,200 @@
+/* (C) 2015 Tom Wright */
+
+#ifdef LWE_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "trace.h"
+
+/*
+ * Histograms are log-linear: values under 2^SUBBITS nanoseconds get a
+ * bucket each, and every power of two above that is split into
+ * 2^SUBBITS buckets, so a bucket is within about 3% of its values.
+ */
+#define SUBBITS 5
+#define SUBS (1 << SUBBITS)
+#define NBUCKETS ((64 - SUBBITS + 1) * SUBS)
+#define NHISTS (TRACE_NPHASES + 1)
+#define TOTAL TRACE_NPHASES
+
+struct hist {
+	uint64_t counts[NBUCKETS];
+	uint64_t n, sum, min, max;
+};
+
+static const char *names[NHISTS] = {
+	"other", "edit", "undo", "layout", "draw", "refresh", "total",
+};
+
+static struct hist hists[NHISTS];
+static uint64_t acc[TRACE_NPHASES];
+static uint64_t framestart, phasestart;
+static int phase, inframe;
+
+static uint64_t now(void);
+static int bucket(uint64_t v);
+static uint64_t bucketval(int b);
+static void record(struct hist *h, uint64_t v);
+static uint64_t percentile(struct hist *h, double p);
+static void account(uint64_t t);
+static void dumponexit(void);
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static int bucket(uint64_t v)
+{
+	int e;
+	if (v < SUBS)
+		return v;
+	for (e = SUBBITS; e < 63 && v >> (e + 1); e++)
+		;
+	return (e - SUBBITS + 1) * SUBS + (int)((v >> (e - SUBBITS)) - SUBS);
+}
+
+/* The smallest value that lands in bucket b. */
+static uint64_t bucketval(int b)
+{
+	int k;
+	if (b < SUBS)
+		return b;
+	k = b / SUBS - 1;
+	return (uint64_t)(b % SUBS + SUBS) << k;
+}
+
+static void record(struct hist *h, uint64_t v)
+{
+	h->counts[bucket(v)]++;
+	if (h->n == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->n++;
+	h->sum += v;
+}
+
+static uint64_t percentile(struct hist *h, double p)
+{
+	uint64_t want = (uint64_t)(h->n * p / 100.0 + 0.5), seen = 0;
+	int b;
+	if (want == 0)
+		want = 1;
+	for (b = 0; b < NBUCKETS; b++) {
+		seen += h->counts[b];
+		if (seen >= want)
+			return bucketval(b) > h->max ? h->max : bucketval(b);
+	}
+	return h->max;
+}
+
+/* Charges the time since the last phase change to the current phase. */
+static void account(uint64_t t)
+{
+	acc[phase] += t - phasestart;
+	phasestart = t;
+}
+
+static void dumponexit(void)
+{
+	tracedump(stderr);
+}
+
+void tracekey(void)
+{
+	static int registered;
+	int i;
+	if (!registered) {
+		registered = 1;
+		atexit(dumponexit);
+	}
+	for (i = 0; i < TRACE_NPHASES; i++)
+		acc[i] = 0;
+	framestart = phasestart = now();
+	phase = TRACE_OTHER;
+	inframe = 1;
+}
+
+void traceframe(void)
+{
+	uint64_t t;
+	int i;
+	if (!inframe)
+		return;
+	t = now();
+	account(t);
+	for (i = 0; i < TRACE_NPHASES; i++)
+		record(&hists[i], acc[i]);
+	record(&hists[TOTAL], t - framestart);
+	inframe = 0;
+}
+
+int traceenter(int p)
+{
+	int prev = phase;
+	if (inframe)
+		account(now());
+	phase = p;
+	return prev;
+}
+
+void traceleave(int prev)
+{
+	if (inframe)
+		account(now());
+	phase = prev;
+}
+
+void tracedump(FILE *f)
+{
+	static const double pcts[] = { 50, 90, 99, 99.9, 100 };
+	struct hist *t = &hists[TOTAL];
+	uint64_t top;
+	int i, j, b;
+	fprintf(f, "key to frame latency, %llu frames (us)\n",
+	        (unsigned long long)t->n);
+	fprintf(f, "%-8s %10s %10s %10s %10s %10s %10s\n", "phase",
+	        "mean", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < NHISTS; i++) {
+		struct hist *h = &hists[i];
+		fprintf(f, "%-8s %10.1f", names[i],
+		        h->n ? h->sum / 1e3 / h->n : 0.0);
+		for (j = 0; j < 5; j++)
+			fprintf(f, " %10.1f", h->n ? percentile(h, pcts[j]) / 1e3 : 0.0);
+		fprintf(f, "\n");
+	}
+	/* A distribution of the totals by power of two. */
+	top = 0;
+	for (b = 0; b < NBUCKETS; b += SUBS) {
+		uint64_t c = 0;
+		for (j = 0; j < SUBS; j++)
+			c += t->counts[b + j];
+		if (c > top)
+			top = c;
+	}
+	for (b = 0; b < NBUCKETS && top; b += SUBS) {
+		uint64_t c = 0;
+		for (j = 0; j < SUBS; j++)
+			c += t->counts[b + j];
+		if (!c)
+			continue;
+		fprintf(f, "%12.1f us %8llu ", bucketval(b) / 1e3,
+		        (unsigned long long)c);
+		for (j = 0; j < (int)(c * 50 / top); j++)
+			fputc('#', f);
+		fputc('\n', f);
+	}
+}
+
+#else
+
+/* Tracing is compiled out; see trace.h. */
+extern int trace_disabled;
+
+#endif
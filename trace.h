@@ -0,0 +1,48 @@
+/* (C) 2015 Tom Wright */
+
+/*
+ * Per-key latency tracing.  Build with -DLWE_TRACE (see config.mk) to
+ * time every key from the moment getkey returns it until the next frame
+ * is presented.  The time in between is split into phases: buffer edits,
+ * undo recording, layout, drawing and the curses refresh.  Whatever is
+ * left over counts as "other".  Each phase gets a log-linear histogram,
+ * in the style of HdrHistogram.  The histograms are printed to stderr
+ * on exit, or appended to a file with C-t.  Without LWE_TRACE the macros
+ * below compile to nothing.
+ */
+
+#ifdef LWE_TRACE
+
+#include <stdio.h>
+
+enum tracephase {
+	TRACE_OTHER,
+	TRACE_EDIT,
+	TRACE_UNDO,
+	TRACE_LAYOUT,
+	TRACE_DRAW,
+	TRACE_REFRESH,
+	TRACE_NPHASES
+};
+
+void tracekey(void);
+void traceframe(void);
+int traceenter(int phase);
+void traceleave(int prev);
+void tracedump(FILE *f);
+
+/* TRACE_ENTER declares a variable, so it goes at the top of a block,
+ * and TRACE_LEAVE must run before every return from that block. */
+#define TRACE_KEY() tracekey()
+#define TRACE_FRAME() traceframe()
+#define TRACE_ENTER(phase) int trace_prev = traceenter(phase)
+#define TRACE_LEAVE() traceleave(trace_prev)
+
+#else
+
+#define TRACE_KEY() ((void)0)
+#define TRACE_FRAME() ((void)0)
+#define TRACE_ENTER(phase) ((void)0)
+#define TRACE_LEAVE() ((void)0)
+
+#endif
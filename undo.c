@@ -1,40 +1,87 @@
 /* (C) 2015 Tom Wright */
 
+#define _GNU_SOURCE	/* fallocate */
 #include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "undo.h"
 #include "buffer.h"
+#include "err.h"
+#include "lz.h"
+#include "stats.h"
+#include "text.h"
+#include "trace.h"
 
 #define INIT_UNDO_SZ 128
+#define SPILL_FILE "lwe_undo_XXXXXX"
 
 enum action {
 	INSERT,
 	DELETE
 };
 
+/* A delete's text once it's old enough to be compressed.  The
+ * compressed bytes are in memory, or in the spill file at off. */
+struct packed {
+	size_t sz;
+	char *data;
+	off_t off;
+};
+
 struct step {
 	enum action a;
 	unsigned s;
-	unsigned start;
-	unsigned end;
-	char *text;
+	size_t start;
+	size_t end;
+	struct text *text;
+	struct packed *p;	/* the text, compressed, instead of text */
+};
+
+/* The undo history of one buffer. */
+struct undo {
+	unsigned us, rs; /* current step number */
+	/* undo / redo step struct list, and head of list */
+	struct step *u, *uh, *r, *rh;
+	unsigned ua, ra; /* allocated size */
+	/* Text held in memory as is and compressed, and how many of the
+	 * oldest undo steps have been compressed and spilled (see pack). */
+	size_t raw, packed;
+	unsigned npacked, nspilled;
 };
 
-static unsigned us, rs; /* current step number */
-/* undo / redo step struct list, and head of list */
-static struct step *u, *uh, *r, *rh;
-static unsigned ua, ra; /* allocated size */
+/*
+ * Each history keeps at most `budget` bytes of deleted text in memory as
+ * is, and as much again compressed.  Past that, the oldest steps' text
+ * is compressed, and then the oldest compressed text is spilled to a
+ * temporary file, which is unlinked as soon as it's made.
+ */
+static size_t budget = (size_t)256 << 20;
+static int spillfd = -1;
+static off_t spillend;
 
 static int checkalloc(struct step **l, struct step **h, unsigned *a);
-static int undosingle(void);
-static int redosingle(void);
-static void resetr(void);
+static int undosingle(struct undo *un);
+static int redosingle(struct undo *un);
+static void resetr(struct undo *un);
+static void clamp(struct undo *un);
+static void droptext(struct undo *un, struct step *s);
+static struct text *steptext(struct step *s);
+static int packtext(struct undo *un, struct step *s);
+static int openspill(void);
+static int spill(struct undo *un, struct packed *p);
+static void unspill(struct packed *p);
+static void pack(struct undo *un);
 static int storeins(struct step **l, struct step **h, unsigned *a,
-                    unsigned s, char *start, char *end);
-static int storedel(struct step **l, struct step **h, unsigned *a,
-                    unsigned s, char *start, char *end);
+                    unsigned s, size_t start, size_t end);
+static int storedel(struct undo *un, struct step **l, struct step **h,
+                    unsigned *a, unsigned s, size_t start, size_t end,
+                    struct text *t);
+static int follows(struct step *ins, int up);
+static long replacerun(struct undo *un, int undoing);
 
 /* Creates undo/redo list if needed, and ensures space for items. */
 static int checkalloc(struct step **l, struct step **h, unsigned *a)
@@ -56,70 +103,362 @@ static int checkalloc(struct step **l, struct step **h, unsigned *a)
 	return 0;
 }
 
-static int undosingle()
+static int undosingle(struct undo *un)
 {
-	char *st;
-	unsigned tsz;
+	struct step *uh = un->uh;
+	struct text *text;
+	char *st, *t;
+	size_t tsz;
 	st = getbufstart();
 	switch (uh->a) {
 	case INSERT:
-		if (storedel(&r, &rh, &ra, rs, st + uh->start, st + uh->end) < 0)
+		if (storedel(un, &un->r, &un->rh, &un->ra, un->rs,
+		             uh->start, uh->end, NULL) < 0)
 			return -1;
 		bufdelete(st + uh->start, st + uh->end);
 		break;
 	case DELETE:
+		if (!(text = steptext(uh)))
+			return -1;
 		tsz = uh->end - uh->start;
-		if (!bufinsertstr(uh->text, uh->text + tsz, st + uh->start))
+		t = textdata(text);
+		t = bufinsertstr(t, t + tsz, st + uh->start);
+		textunref(text);
+		if (!t)
 			return -1;
-		if (storeins(&r, &rh, &ra, rs, st + uh->start, st + uh->end) < 0)
+		if (storeins(&un->r, &un->rh, &un->ra, un->rs, uh->start,
+		             uh->end) < 0)
 			return -1;
 		break;
 	}
-	free(uh->text);
-	uh->text = NULL;
-	uh--;
+	droptext(un, uh);
+	un->uh--;
+	clamp(un);
 	return 0;
 }
 
-static int redosingle()
+static int redosingle(struct undo *un)
 {
-	char *st;
-	unsigned tsz;
+	struct step *rh = un->rh;
+	char *st, *t;
+	size_t tsz;
 	st = getbufstart();
 	switch (rh->a) {
 	case INSERT:
-		if (storedel(&u, &uh, &ua, us, st + rh->start, st + rh->end) < 0)
+		if (storedel(un, &un->u, &un->uh, &un->ua, un->us,
+		             rh->start, rh->end, NULL) < 0)
 			return -1;
 		bufdelete(st + rh->start, st + rh->end);
 		break;
 	case DELETE:
 		tsz = rh->end - rh->start;
-		if (!bufinsertstr(rh->text, rh->text + tsz, st + rh->start))
+		t = textdata(rh->text);
+		if (!bufinsertstr(t, t + tsz, st + rh->start))
 			return -1;
-		if (storeins(&u, &uh, &ua, us, st + rh->start, st + rh->end) < 0)
+		if (storeins(&un->u, &un->uh, &un->ua, un->us, rh->start,
+		             rh->end) < 0)
 			return -1;
 		break;
 	}
-	free(rh->text);
-	rh->text = NULL;
-	rh--;
+	droptext(un, rh);
+	un->rh--;
+	return 0;
+}
+
+/*
+ * Whether the replacement whose insert is at `ins` comes after the one
+ * before it in the list (its insert at ins + 2, its delete at ins + 1):
+ * further on in the text if `up`, otherwise further back.
+ */
+static int follows(struct step *ins, int up)
+{
+	if (up)
+		return ins->start >= ins[2].start + (ins[1].end - ins[1].start);
+	return ins->end <= ins[2].start;
+}
+
+/*
+ * Undoes or redoes the run of replacements at the head of a list, each an
+ * insert and then the delete of what it replaced, as a bang records them.
+ * They are made in one bufpatch rather than with two moves of the text
+ * after each.  The run has to work through the text in one direction,
+ * front to back or back to front, and the other list gets the same steps
+ * undosingle and redosingle would have given it.  Returns how many
+ * replacements were made, 0 if there isn't a run of two or more at the
+ * head, or -1 on failure.
+ */
+static long replacerun(struct undo *un, int undoing)
+{
+	struct step *l = undoing ? un->u : un->r;
+	struct step *h = undoing ? un->uh : un->rh;
+	struct step **tl = undoing ? &un->r : &un->u;
+	struct step **th = undoing ? &un->rh : &un->uh;
+	unsigned *ta = undoing ? &un->ra : &un->ua;
+	unsigned ts = undoing ? un->rs : un->us;
+	unsigned lim = undoing ? un->us : un->rs;
+	struct step *ins, *del;
+	struct patch *p = NULL;
+	struct text **old = NULL, **new = NULL;
+	long n, k, avail = h - l + 1, shift = 0, err = -1;
+	char *st = getbufstart();
+	int up = 0;
+	for (n = 0; 2 * n + 2 <= avail; n++) {
+		ins = h - 2 * n;
+		del = ins - 1;
+		if (ins->a != INSERT || del->a != DELETE || ins->s < lim ||
+		    del->s < lim || del->start != ins->start)
+			break;
+		if (n == 1)
+			up = follows(ins, 1);
+		if (n >= 1 && !follows(ins, up))
+			break;
+	}
+	if (n < 2)
+		return 0;
+	p = malloc(n * sizeof(*p));
+	old = calloc(n, sizeof(*old));
+	new = calloc(n, sizeof(*new));
+	if (!p || !old || !new) {
+		seterr("memory");
+		goto out;
+	}
+	/* Where each is in the text as it is now, front to back. */
+	for (k = 0; k < n; k++) {
+		ins = h - 2 * k;
+		del = ins - 1;
+		p[up ? k : n - 1 - k] = (struct patch) {
+			.off = up ? ins->start - shift : ins->start,
+			.len = ins->end - ins->start,
+			.sz = del->end - del->start
+		};
+		shift += (long)(del->end - del->start) -
+		         (long)(ins->end - ins->start);
+		if (!(new[k] = steptext(del)))
+			goto out;
+		p[up ? k : n - 1 - k].data = textdata(new[k]);
+		if (!(old[k] = textnew(st + p[up ? k : n - 1 - k].off,
+		                       st + p[up ? k : n - 1 - k].off +
+		                       (ins->end - ins->start))))
+			goto out;
+	}
+	if (bufpatch(p, n) < 0)
+		goto out;
+	for (k = 0; k < n; k++) {
+		ins = h - 2 * k;
+		del = ins - 1;
+		if (storedel(un, tl, th, ta, ts, ins->start, ins->end,
+		             old[k]) < 0 ||
+		    storeins(tl, th, ta, ts, del->start, del->end) < 0)
+			goto out;
+		droptext(un, ins);
+		droptext(un, del);
+	}
+	if (undoing) {
+		un->uh -= 2 * n;
+		clamp(un);
+	} else {
+		un->rh -= 2 * n;
+	}
+	err = n;
+out:
+	for (k = 0; new && k < n; k++) {
+		textunref(new[k]);
+		textunref(old[k]);
+	}
+	free(p);
+	free(old);
+	free(new);
+	return err;
+}
+
+static void resetr(struct undo *un)
+{
+	while (un->rh && un->rh >= un->r) {
+		droptext(un, un->rh);
+		un->rh--;
+	}
+	un->rs = 0;
+}
+
+/* Keeps the packed and spilled counts within the undo list after a pop. */
+static void clamp(struct undo *un)
+{
+	unsigned n = un->uh + 1 - un->u;
+	if (un->npacked > n)
+		un->npacked = n;
+	if (un->nspilled > n)
+		un->nspilled = n;
+}
+
+static void droptext(struct undo *un, struct step *s)
+{
+	if (s->text) {
+		un->raw -= textsz(s->text);
+		memsub(&stats.undobytes, textsz(s->text));
+	}
+	textunref(s->text);
+	s->text = NULL;
+	if (s->p && s->p->data) {
+		un->packed -= s->p->sz;
+		memsub(&stats.undobytes, s->p->sz);
+		free(s->p->data);
+	} else if (s->p) {
+		unspill(s->p);
+	}
+	free(s->p);
+	s->p = NULL;
+}
+
+/* Returns a delete's text, decompressing it if need be.  The caller
+ * drops the reference.  Returns NULL (with the error set) on failure. */
+static struct text *steptext(struct step *s)
+{
+	struct text *t;
+	size_t sz = s->end - s->start, pg, skip;
+	char *m;
+	int err;
+	if (s->text)
+		return textref(s->text);
+	if (!(t = textalloc(sz)))
+		return NULL;
+	if (s->p->data) {
+		err = lzunpack(s->p->data, s->p->sz, textdata(t), sz);
+	} else {
+		pg = sysconf(_SC_PAGESIZE);
+		skip = s->p->off % pg;
+		m = mmap(NULL, skip + s->p->sz, PROT_READ, MAP_PRIVATE,
+		         spillfd, s->p->off - skip);
+		if (m == MAP_FAILED) {
+			textunref(t);
+			seterr("undo spill file");
+			return NULL;
+		}
+		err = lzunpack(m + skip, s->p->sz, textdata(t), sz);
+		munmap(m, skip + s->p->sz);
+	}
+	if (err < 0) {
+		textunref(t);
+		seterr("undo text damaged");
+		return NULL;
+	}
+	return t;
+}
+
+static int packtext(struct undo *un, struct step *s)
+{
+	size_t sz = textsz(s->text);
+	struct packed *p;
+	char *data;
+	if (!(p = malloc(sizeof(*p))))
+		return -1;
+	if (!(p->data = malloc(lzbound(sz))) ||
+	    !(p->sz = lzpack(textdata(s->text), sz, p->data))) {
+		free(p->data);
+		free(p);
+		return -1;
+	}
+	if ((data = realloc(p->data, p->sz)))
+		p->data = data;
+	p->off = 0;
+	un->raw -= sz;
+	memsub(&stats.undobytes, sz);
+	un->packed += p->sz;
+	memadd(&stats.undobytes, p->sz);
+	textunref(s->text);
+	s->text = NULL;
+	s->p = p;
+	return 0;
+}
+
+static int openspill(void)
+{
+	char path[8192], *dir;
+	if (!(dir = getenv("TMPDIR")) || dir[0] == '\0')
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/%s", dir, SPILL_FILE);
+	if ((spillfd = mkstemp(path)) < 0)
+		return -1;
+	unlink(path);
+	return 0;
+}
+
+static int spill(struct undo *un, struct packed *p)
+{
+	size_t done;
+	ssize_t n;
+	if (spillfd < 0 && openspill() < 0)
+		return -1;
+	for (done = 0; done < p->sz; done += n) {
+		n = pwrite(spillfd, p->data + done, p->sz - done,
+		           spillend + done);
+		if (n <= 0)
+			return -1;
+	}
+	p->off = spillend;
+	spillend += p->sz;
+	un->packed -= p->sz;
+	memsub(&stats.undobytes, p->sz);
+	stats.undodisk += p->sz;
+	free(p->data);
+	p->data = NULL;
 	return 0;
 }
 
-static void resetr()
+/* Frees a spilled text's space.  Undo takes the newest first, which were
+ * spilled last, so usually the file can just be cut short. */
+static void unspill(struct packed *p)
 {
-	while (rh && rh >= r) {
-		free(rh->text);
-		rh->text = NULL;
-		rh--;
+	stats.undodisk -= p->sz;
+	if (p->off + (off_t)p->sz == spillend) {
+		spillend = p->off;
+		if (ftruncate(spillfd, spillend) < 0)
+			return;
+	} else {
+#ifdef FALLOC_FL_PUNCH_HOLE
+		fallocate(spillfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		          p->off, p->sz);
+#endif
 	}
-	rs = 0;
 }
 
+/*
+ * Brings the history back under budget, oldest steps first.  The step
+ * just finished is left as is, being the likeliest to be undone.  If
+ * compressing or spilling fails, the text just stays where it is.
+ */
+static void pack(struct undo *un)
+{
+	unsigned n = un->uh ? un->uh + 1 - un->u : 0;
+	struct step *s;
+	if (budget == 0)
+		return;
+	while (un->raw > budget && un->npacked < n) {
+		s = &un->u[un->npacked];
+		if (s->s + 1 >= un->us)
+			break;
+		if (s->text && packtext(un, s) < 0)
+			break;
+		un->npacked++;
+	}
+	while (un->packed > budget && un->nspilled < un->npacked) {
+		s = &un->u[un->nspilled];
+		if (s->p && s->p->data && spill(un, s->p) < 0)
+			break;
+		un->nspilled++;
+	}
+}
+
+/* Records an insert of [start, end), given as offsets into the buffer. */
 static int storeins(struct step **l, struct step **h, unsigned *a,
-                    unsigned s, char *start, char *end)
+                    unsigned s, size_t start, size_t end)
 {
-	assert(inbuf(start) && inbuf(end));
+	/* Typing extends the insert just before it in the same step.  The
+	 * head is just before the list once it's been emptied. */
+	if (*h && *h >= *l && (*h)->a == INSERT && (*h)->s == s &&
+	    (*h)->end == start) {
+		(*h)->end = end;
+		return 0;
+	}
 	if (checkalloc(l, h, a) < 0)
 		return -1;
 	if (!*h)
@@ -128,16 +467,24 @@ static int storeins(struct step **l, struct step **h, unsigned *a,
 		(*h)++;
 	(*h)->a = INSERT;
 	(*h)->s = s;
-	(*h)->start = start - getbufstart();
-	(*h)->end = end - getbufstart();
+	(*h)->start = start;
+	(*h)->end = end;
 	(*h)->text = NULL;
+	(*h)->p = NULL;
+	stats.undosteps++;
 	return 0;
 }
 
-static int storedel(struct step **l, struct step **h, unsigned *a,
-                    unsigned s, char *start, char *end)
+/*
+ * Records a delete of [start, end), given as offsets into the buffer.  If
+ * `t` is NULL the text is copied from the buffer, otherwise the step
+ * takes a reference to `t`, which must hold the bytes deleted.
+ */
+static int storedel(struct undo *un, struct step **l, struct step **h,
+                    unsigned *a, unsigned s, size_t start, size_t end,
+                    struct text *t)
 {
-	assert(inbuf(start) && inbuf(end));
+	char *st = getbufstart();
 	if (checkalloc(l, h, a) < 0)
 		return -1;
 	if (!*h)
@@ -146,60 +493,154 @@ static int storedel(struct step **l, struct step **h, unsigned *a,
 		(*h)++;
 	(*h)->a = DELETE;
 	(*h)->s = s;
-	(*h)->start = start - getbufstart();
-	(*h)->end = end - getbufstart();
-	(*h)->text = malloc(end - start);
-	if (!(*h)->text) {
-		(*h)--;
+	(*h)->start = start;
+	(*h)->end = end;
+	(*h)->p = NULL;
+	if (t) {
+		assert(textsz(t) == end - start);
+		(*h)->text = textref(t);
+	} else if (!((*h)->text = textnew(st + start, st + end))) {
+		if (*h == *l)
+			*h = NULL;
+		else
+			(*h)--;
 		return -1;
 	}
-	strncpy((*h)->text, start, end - start);
+	stats.undosteps++;
+	un->raw += end - start;
+	memadd(&stats.undobytes, end - start);
 	return 0;
 }
 
+struct undo *undonew(void)
+{
+	return calloc(1, sizeof(struct undo));
+}
+
+void undofree(struct undo *un)
+{
+	if (un == NULL)
+		return;
+	resetr(un);
+	while (un->uh && un->uh >= un->u) {
+		droptext(un, un->uh);
+		un->uh--;
+	}
+	free(un->u);
+	free(un->r);
+	free(un);
+}
+
 int recinsert(char *start, char *end)
 {
-	if (storeins(&u, &uh, &ua, us, start, end) < 0)
-		return -1;
-	resetr();
-	return 0;
+	struct undo *un = bufundo();
+	int err = 0;
+	assert(inbuf(start) && inbuf(end));
+	TRACE_ENTER(TRACE_UNDO);
+	if (storeins(&un->u, &un->uh, &un->ua, un->us, start - getbufstart(),
+	             end - getbufstart()) < 0)
+		err = -1;
+	else
+		resetr(un);
+	TRACE_LEAVE();
+	return err;
 }
 
 int recdelete(char *start, char *end)
 {
-	if (storedel(&u, &uh, &ua, us, start, end) < 0)
-		return -1;
-	resetr();
-	return 0;
+	return recdeletetext(start, end, NULL);
+}
+
+int recdeletetext(char *start, char *end, struct text *t)
+{
+	struct undo *un = bufundo();
+	int err = 0;
+	assert(inbuf(start) && inbuf(end));
+	TRACE_ENTER(TRACE_UNDO);
+	if (storedel(un, &un->u, &un->uh, &un->ua, un->us,
+	             start - getbufstart(), end - getbufstart(), t) < 0)
+		err = -1;
+	else
+		resetr(un);
+	TRACE_LEAVE();
+	return err;
+}
+
+int recreplace(char *start, char *end, size_t sz)
+{
+	return recreplacetext(start, end, sz, NULL);
+}
+
+int recreplacetext(char *start, char *end, size_t sz, struct text *t)
+{
+	struct undo *un = bufundo();
+	size_t o = start - getbufstart();
+	int err = 0;
+	assert(inbuf(start) && inbuf(end));
+	TRACE_ENTER(TRACE_UNDO);
+	if (storedel(un, &un->u, &un->uh, &un->ua, un->us, o,
+	             end - getbufstart(), t) < 0 ||
+	    storeins(&un->u, &un->uh, &un->ua, un->us, o, o + sz) < 0)
+		err = -1;
+	else
+		resetr(un);
+	TRACE_LEAVE();
+	return err;
 }
 
 void recstep()
 {
+	struct undo *un = bufundo();
 	/* Checks the step of the head; don't record empty steps. */
-	if (uh && uh->s == us)
-		us++;
+	if (un->uh && un->uh->s == un->us) {
+		un->us++;
+		pack(un);
+	}
+}
+
+void undobudget(size_t sz)
+{
+	budget = sz;
 }
 
 int undo()
 {
-	if (us == 0)
-		return 0;
-	us--;
-	while (uh && uh >= u && uh->s >= us)
-		if (undosingle() < 0)
-			return -1;
-	rs++;
-	return 0;
+	struct undo *un = bufundo();
+	long n;
+	int err = 0;
+	TRACE_ENTER(TRACE_UNDO);
+	if (un->us == 0)
+		goto out;
+	un->us--;
+	while (un->uh && un->uh >= un->u && un->uh->s >= un->us) {
+		if ((n = replacerun(un, 1)) < 0 || (!n && undosingle(un) < 0)) {
+			err = -1;
+			goto out;
+		}
+	}
+	un->rs++;
+	out:
+	TRACE_LEAVE();
+	return err;
 }
 
 int redo()
 {
-	if (rs == 0)
-		return 0;
-	rs--;
-	while (rh && rh >= r && rh->s >= rs)
-		if (redosingle() < 0)
-			return -1;
-	us++;
-	return 0;
+	struct undo *un = bufundo();
+	long n;
+	int err = 0;
+	TRACE_ENTER(TRACE_UNDO);
+	if (un->rs == 0)
+		goto out;
+	un->rs--;
+	while (un->rh && un->rh >= un->r && un->rh->s >= un->rs) {
+		if ((n = replacerun(un, 0)) < 0 || (!n && redosingle(un) < 0)) {
+			err = -1;
+			goto out;
+		}
+	}
+	un->us++;
+	out:
+	TRACE_LEAVE();
+	return err;
 }
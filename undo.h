@@ -1,5 +1,17 @@
 /* (C) 2015 Tom Wright */
 
+#include <stddef.h>
+
+struct text;
+struct undo;
+
+/*
+ * Each buffer has its own undo history (see buffer.h); the functions
+ * below work on the current buffer's.
+ */
+struct undo *undonew(void);
+void undofree(struct undo *un);
+
 /*
  * Record actions for undo.  Start / end are the start and end
  * points of the action in the buffer.  Inserts should be recorded
@@ -11,6 +23,30 @@ int recinsert(char *start, char *end);
 int recdelete(char *start, char *end);
 void recstep(void);
 
+/*
+ * Like recdelete, but shares an existing copy of the deleted text (for
+ * example one already stored in the yank ring) instead of making a new
+ * one.  `t` must contain exactly the bytes in [start, end).
+ */
+int recdeletetext(char *start, char *end, struct text *t);
+
+/*
+ * Records replacing [start, end) with `sz` new bytes, as a delete and
+ * then an insert.  Unlike the others it is called before the buffer
+ * changes, so that a run of replacements can be recorded back to front
+ * against the text they came from and then made in one go.
+ */
+int recreplace(char *start, char *end, size_t sz);
+/* Like recreplace, but shares `t`, which must hold [start, end). */
+int recreplacetext(char *start, char *end, size_t sz, struct text *t);
+
+/*
+ * Sets how much deleted text each history keeps in memory: `sz` bytes as
+ * is, and as much again compressed, with older text compressed and then
+ * moved to a temporary file past that.  0 means no limit.
+ */
+void undobudget(size_t sz);
+
 /*
  * Perform an undo / redo.  Returns 0 on success and -1 on failure.
  */
@@ -0,0 +1,93 @@
+/* (C) 2015 Tom Wright */
+
+/* For wcwidth. */
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "utf8.h"
+
+/* Word-at-a-time byte tests: ONES has 0x01 in every byte and HIGH has
+ * 0x80.  HASLESS is non-zero if some byte of x is less than n. */
+#define ONES ((uint64_t)-1 / 255)
+#define HIGH (ONES * 0x80)
+#define HASLESS(x, n) (((x) - ONES * (n)) & ~(x) & HIGH)
+#define HASZERO(x) HASLESS(x, 1)
+
+/* Display widths of the Basic Multilingual Plane, cached as they're
+ * met since wcwidth is slow enough to show up in a frame.  Entries hold
+ * the width plus two, so zero means not looked up yet. */
+static signed char widths[0x10000];
+
+static int decode(const unsigned char *p, const unsigned char *end,
+                  uint32_t *cp);
+static int width(uint32_t cp);
+
+/* Decodes the UTF-8 sequence at p.  Returns its length, or 0 if it
+ * isn't valid (truncated, overlong, a surrogate or out of range). */
+static int decode(const unsigned char *p, const unsigned char *end,
+                  uint32_t *cp)
+{
+	static const uint32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+	int len, i;
+	if (p[0] < 0xc0)
+		return 0;
+	else if (p[0] < 0xe0)
+		len = 2, *cp = p[0] & 0x1f;
+	else if (p[0] < 0xf0)
+		len = 3, *cp = p[0] & 0x0f;
+	else if (p[0] < 0xf5)
+		len = 4, *cp = p[0] & 0x07;
+	else
+		return 0;
+	if (end - p < len)
+		return 0;
+	for (i = 1; i < len; i++) {
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+		*cp = *cp << 6 | (p[i] & 0x3f);
+	}
+	if (*cp < min[len] || *cp > 0x10ffff ||
+	    (*cp >= 0xd800 && *cp < 0xe000))
+		return 0;
+	return len;
+}
+
+static int width(uint32_t cp)
+{
+	if (cp >= 0x10000)
+		return wcwidth(cp);
+	if (widths[cp] == 0)
+		widths[cp] = wcwidth(cp) + 2;
+	return widths[cp] - 2;
+}
+
+int charwidth(const char *p, const char *end, int *len)
+{
+	const unsigned char *u = (const unsigned char *)p;
+	uint32_t cp;
+	*len = 1;
+	if (u[0] < 0x80)
+		return u[0] >= 0x20 && u[0] < 0x7f ? 1 : -1;
+	if (!(*len = decode(u, (const unsigned char *)end, &cp))) {
+		*len = 1;
+		return -1;
+	}
+	return width(cp);
+}
+
+size_t asciispan(const char *p, const char *end)
+{
+	const char *s = p;
+	uint64_t w;
+	for (; end - s >= 8; s += 8) {
+		memcpy(&w, s, 8);
+		if ((w | HASLESS(w, 0x20) | HASZERO(w ^ ONES * 0x7f)) & HIGH)
+			break;
+	}
+	while (s < end && *s >= 0x20 && *s < 0x7f)
+		s++;
+	return s - p;
+}
@@ -0,0 +1,18 @@
+/* (C) 2015 Tom Wright */
+
+#include <stddef.h>
+
+/*
+ * Character widths for layout.  Text is treated as UTF-8: a valid,
+ * printable sequence takes the columns wcwidth gives it in the current
+ * locale, and anything else is shown as a one column '?'.
+ */
+
+/* Returns the columns the character at p takes, or -1 if it should be
+ * shown as '?', and sets *len to its length in bytes.  p < end, and
+ * tabs and newlines are left to the caller. */
+int charwidth(const char *p, const char *end, int *len);
+
+/* Returns the length of the run of printable ASCII at the start of
+ * [p, end), where every byte is exactly one column. */
+size_t asciispan(const char *p, const char *end);
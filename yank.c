@@ -3,132 +3,338 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <pwd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/file.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include "crc.h"
+#include "stats.h"
+#include "text.h"
 #include "yank.h"
 
 #define N_YANKS 26
 #define LAST_YANK (N_YANKS - 1)
-#define YANK_FILE "/tmp/lwe_yank_"
+#define YANK_FILE "lwe_yank_"
+/* Once saved, entries this big are dropped from memory (all but the
+ * newest) and read back from the yank file when they're put. */
+#define SPILLSZ (1 << 20)
 
-static unsigned yank_sizes[N_YANKS];
-static char *yank_buffers[N_YANKS];
+/*
+ * The yank file is binary:
+ *
+ *	header	"LWEY", u32 version, u32 count, u32 crc32c of the table
+ *	table	count entries of u64 offset, u64 length, u32 crc32c, u32 0
+ *	data	the entry payloads, at the offsets given in the table
+ *
+ * All integers are little endian.  The header and table are small and
+ * checked up front, so loading the yank ring never touches a payload.
+ * A payload is read (and its checksum verified) the first time the
+ * entry is used.
+ */
+#define YANK_MAGIC "LWEY"
+#define YANK_VERSION 1
+#define HDR_SZ 16
+#define ENT_SZ 24
+
+struct yank {
+	struct text *t;	/* NULL until the payload is read from yankfd */
+	uint64_t off;
+	uint64_t sz;
+	uint32_t crc;
+	int hascrc;
+};
 
+static struct yank yanks[N_YANKS];
+static int nyanks;
+/* The yank file that unread payloads live in: the one last loaded or
+ * saved.  saveyanks replaces the file by renaming over it, so this
+ * descriptor keeps seeing the snapshot the table belongs to, until
+ * loadyanks finds another lwe has put a new one at the path.  Nothing
+ * reads the file at startup; the first put or yank does. */
+static int yankfd = -1;
+
+static void droptext(struct yank *y);
 static void shiftyanks(void);
+static void clearyanks(void);
 static int yank_filename(char buf[8192]);
+static int current(char *filename);
+static void put32(unsigned char *p, uint32_t v);
+static void put64(unsigned char *p, uint64_t v);
+static uint32_t get32(unsigned char *p);
+static uint64_t get64(unsigned char *p);
+static int readall(int fd, void *buf, size_t sz, uint64_t off);
+static int writeall(int fd, void *buf, size_t sz);
+static int copypayload(int fd, struct yank *y);
+static int loadpayload(struct yank *y);
 
 /*
- * Yanked text is stored in malloc'd buffers.  The yanks array is an
- * array of pointers to these buffers.  When a new item is yanked, we
- * want to shift everything down, dropping the last item in order to
+ * Yanked text is stored in shared text objects (see text.h).  The yanks
+ * array holds a reference to each of them.  When a new item is yanked,
+ * we want to shift everything down, dropping the last item in order to
  * make room for the new item.
  */
+static void droptext(struct yank *y)
+{
+	if (y->t)
+		memsub(&stats.yankbytes, y->sz);
+	textunref(y->t);
+	y->t = NULL;
+}
+
 static void shiftyanks()
 {
-	if (yank_buffers[LAST_YANK] != NULL)
-		free(yank_buffers[LAST_YANK]);
-	memmove(&yank_buffers[1], &yank_buffers[0],
-			sizeof(yank_buffers[0]) * LAST_YANK);
-	memmove(&yank_sizes[1], &yank_sizes[0],
-			sizeof(yank_sizes[0]) * LAST_YANK);
+	droptext(&yanks[LAST_YANK]);
+	memmove(&yanks[1], &yanks[0], sizeof(yanks[0]) * LAST_YANK);
+	memset(&yanks[0], 0, sizeof(yanks[0]));
+	if (nyanks < N_YANKS)
+		nyanks++;
+}
+
+static void clearyanks()
+{
+	int i;
+	for (i = 0; i < nyanks; i++)
+		droptext(&yanks[i]);
+	memset(yanks, 0, sizeof(yanks));
+	nyanks = 0;
 }
 
 static int yank_filename(char filename[8192])
 {
 	struct passwd *pwd;
+	char *dir;
 	uid_t u;
 	u = getuid();
 	if (!(pwd = getpwuid(u)))
 		return -1;
-	snprintf(filename, 8192, "%s%s", YANK_FILE, pwd->pw_name);
+	if (!(dir = getenv("TMPDIR")) || dir[0] == '\0')
+		dir = "/tmp";
+	snprintf(filename, 8192, "%s/%s%s", dir, YANK_FILE, pwd->pw_name);
+	return 0;
+}
+
+/* Whether yankfd is still the file at filename. */
+static int current(char *filename)
+{
+	struct stat a, b;
+	return yankfd >= 0 && fstat(yankfd, &a) == 0 &&
+	       stat(filename, &b) == 0 && a.st_dev == b.st_dev &&
+	       a.st_ino == b.st_ino;
+}
+
+static void put32(unsigned char *p, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		p[i] = v >> (8 * i);
+}
+
+static void put64(unsigned char *p, uint64_t v)
+{
+	for (int i = 0; i < 8; i++)
+		p[i] = v >> (8 * i);
+}
+
+static uint32_t get32(unsigned char *p)
+{
+	uint32_t v = 0;
+	for (int i = 3; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static uint64_t get64(unsigned char *p)
+{
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static int readall(int fd, void *buf, size_t sz, uint64_t off)
+{
+	char *p = buf;
+	while (sz > 0) {
+		ssize_t r = pread(fd, p, sz, off);
+		if (r <= 0)
+			return -1;
+		p += r;
+		off += r;
+		sz -= r;
+	}
+	return 0;
+}
+
+static int writeall(int fd, void *buf, size_t sz)
+{
+	char *p = buf;
+	while (sz > 0) {
+		ssize_t w = write(fd, p, sz);
+		if (w < 0)
+			return -1;
+		p += w;
+		sz -= w;
+	}
+	return 0;
+}
+
+/* Streams an unread payload from the old yank file into fd. */
+static int copypayload(int fd, struct yank *y)
+{
+	char chunk[65536];
+	uint64_t done, n;
+	for (done = 0; done < y->sz; done += n) {
+		n = y->sz - done;
+		if (n > sizeof(chunk))
+			n = sizeof(chunk);
+		if (readall(yankfd, chunk, n, y->off + done) < 0)
+			return -1;
+		if (writeall(fd, chunk, n) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* Reads and verifies a payload.  Returns 0 on success and -1 if it can't
+ * be read or doesn't match its checksum. */
+static int loadpayload(struct yank *y)
+{
+	struct text *t;
+	if (y->t)
+		return 0;
+	if (yankfd < 0 || !(t = textalloc(y->sz)))
+		return -1;
+	if (readall(yankfd, textdata(t), y->sz, y->off) < 0 ||
+	    crc32c(0, textdata(t), y->sz) != y->crc) {
+		textunref(t);
+		return -1;
+	}
+	y->t = t;
+	memadd(&stats.yankbytes, y->sz);
 	return 0;
 }
 
 int saveyanks()
 {
-	char filename[8192];
-	FILE *f;
-	size_t w;
-	int i, err;
+	char filename[8192], tmpname[8208];
+	unsigned char hdr[HDR_SZ], tbl[N_YANKS * ENT_SZ];
+	uint64_t off, offs[N_YANKS];
+	int i, fd, err;
 	if (yank_filename(filename) < 0)
 		return -1;
-	if (!(f = fopen(filename, "w")))
+	snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", filename);
+	if ((fd = mkstemp(tmpname)) < 0)
 		return -1;
+	off = HDR_SZ + nyanks * ENT_SZ;
+	for (i = 0; i < nyanks; i++) {
+		struct yank *y = &yanks[i];
+		if (!y->hascrc) {
+			y->crc = crc32c(0, textdata(y->t), y->sz);
+			y->hascrc = 1;
+		}
+		offs[i] = off;
+		put64(tbl + i * ENT_SZ, off);
+		put64(tbl + i * ENT_SZ + 8, y->sz);
+		put32(tbl + i * ENT_SZ + 16, y->crc);
+		put32(tbl + i * ENT_SZ + 20, 0);
+		off += y->sz;
+	}
+	memcpy(hdr, YANK_MAGIC, 4);
+	put32(hdr + 4, YANK_VERSION);
+	put32(hdr + 8, nyanks);
+	put32(hdr + 12, crc32c(0, tbl, nyanks * ENT_SZ));
 	err = 0;
-	if (flock(fileno(f), LOCK_EX) < 0) {
+	if (writeall(fd, hdr, HDR_SZ) < 0 ||
+	    writeall(fd, tbl, nyanks * ENT_SZ) < 0) {
 		err = -1;
 		goto close;
 	}
-	for (i = 0; i < N_YANKS; i++) {
-		if (yank_buffers[i] == NULL)
-			break;
-		if (fprintf(f, "%u\n", yank_sizes[i]) < 0) {
-			err = -1;
-			goto close;
-		}
-		w = fwrite(yank_buffers[i], sizeof(char), yank_sizes[i], f);
-		if (w < yank_sizes[i]) {
-			err = -1;
+	for (i = 0; i < nyanks; i++) {
+		if (yanks[i].t)
+			err = writeall(fd, textdata(yanks[i].t), yanks[i].sz);
+		else
+			err = copypayload(fd, &yanks[i]);
+		if (err < 0)
 			goto close;
-		}
-		if (fputc('\n', f) == EOF) {
-			err = -1;
-			goto close;
-		}
 	}
 	close:
-	fclose(f);
-	return err;
+	if (err == 0 && rename(tmpname, filename) < 0)
+		err = -1;
+	if (err < 0) {
+		close(fd);
+		unlink(tmpname);
+		return -1;
+	}
+	/* The new file holds every payload, so read from it from now on,
+	 * and let go of the big copies that aren't likely to be put. */
+	if (yankfd >= 0)
+		close(yankfd);
+	yankfd = fd;
+	for (i = 0; i < nyanks; i++) {
+		yanks[i].off = offs[i];
+		if (i > 0 && yanks[i].sz >= SPILLSZ)
+			droptext(&yanks[i]);
+	}
+	return 0;
 }
 
+/*
+ * Reads the header and table of the yank file, replacing the yank ring.
+ * Payloads are left in the file until they are asked for.  If the file
+ * is missing, truncated, or fails its checksum, the yank ring is left
+ * alone and -1 is returned.  If it's the file the ring was last loaded
+ * from or saved to, there's nothing new to read.
+ */
 int loadyanks()
 {
 	char filename[8192];
-	char line[256];
-	char *new;
-	FILE *f;
-	int i, err;
-	unsigned sz;
+	unsigned char hdr[HDR_SZ], tbl[N_YANKS * ENT_SZ];
+	struct stat st;
+	uint64_t off, sz, datastart;
+	uint32_t n;
+	size_t tblsz;
+	int i, fd;
 	if (yank_filename(filename) < 0)
 		return -1;
-	if (!(f = fopen(filename, "r")))
+	if (current(filename))
+		return 0;
+	if ((fd = open(filename, O_RDONLY)) < 0)
 		return -1;
-	err = 0;
-	if (flock(fileno(f), LOCK_EX) < 0) {
-		err = -1;
-		goto close;
+	if (fstat(fd, &st) < 0 || readall(fd, hdr, HDR_SZ, 0) < 0)
+		goto bad;
+	n = get32(hdr + 8);
+	if (memcmp(hdr, YANK_MAGIC, 4) != 0 ||
+	    get32(hdr + 4) != YANK_VERSION || n > N_YANKS)
+		goto bad;
+	tblsz = (size_t)n * ENT_SZ;
+	if (readall(fd, tbl, tblsz, HDR_SZ) < 0 ||
+	    crc32c(0, tbl, tblsz) != get32(hdr + 12))
+		goto bad;
+	datastart = HDR_SZ + tblsz;
+	for (i = 0; i < (int)n; i++) {
+		off = get64(tbl + i * ENT_SZ);
+		sz = get64(tbl + i * ENT_SZ + 8);
+		if (off < datastart || off > (uint64_t)st.st_size ||
+		    sz > (uint64_t)st.st_size - off)
+			goto bad;
 	}
-	i = 0;
-	do {
-		if (!fgets(line, sizeof(line), f)) {
-			err = -1;
-			goto close;
-		}
-		if (!sscanf(line, " %u ", &sz)) {
-			err = -1;
-			goto close;
-		}
-		yank_sizes[i] = sz;
-		new = realloc(yank_buffers[i], sz);
-		if (!new) {
-			err = -1;
-			goto close;
-		}
-		yank_buffers[i] = new;
-		if (fread(yank_buffers[i], sizeof(char), sz, f) < sz) {
-			err = -1;
-			goto close;
-		}
-		fgetc(f);
-		i++;
-	} while (i < N_YANKS && !feof(f));
-	close:
-	fclose(f);
-	return err;
+	clearyanks();
+	if (yankfd >= 0)
+		close(yankfd);
+	yankfd = fd;
+	for (i = 0; i < (int)n; i++) {
+		yanks[i].off = get64(tbl + i * ENT_SZ);
+		yanks[i].sz = get64(tbl + i * ENT_SZ + 8);
+		yanks[i].crc = get32(tbl + i * ENT_SZ + 16);
+		yanks[i].hascrc = 1;
+	}
+	nyanks = n;
+	return 0;
+	bad:
+	close(fd);
+	return -1;
 }
 
 /*
@@ -136,35 +342,74 @@ int loadyanks()
  */
 int yank_sz()
 {
-	int i;
-	for (i = 0; i < 26; i++)
-		if (yank_buffers[i] == NULL)
-			break;
-	return i;
+	return nyanks;
 }
 
 /*
  * Gets the n'th yank item.  The pointer to the string is stored in the
  * location pointed to by item, and the length is stored in the location
- * pointed to by len.  n should be in the interval [0, yank_sz).
+ * pointed to by len.  n should be in the interval [0, yank_sz).  Returns
+ * 0 on success and -1 if the item couldn't be read back from the yank
+ * file.
  */
-void yank_item(char **item, unsigned *len, int n)
+int yank_item(char **item, size_t *len, int n)
 {
 	assert(n >= 0);
 	assert(n < yank_sz());
-	*item = yank_buffers[n];
-	*len = yank_sizes[n];
+	if (loadpayload(&yanks[n]) < 0)
+		return -1;
+	*item = textdata(yanks[n].t);
+	*len = yanks[n].sz;
+	return 0;
+}
+
+/*
+ * Copies up to sz bytes from the start of the n'th yank item into buf,
+ * without reading the rest of the item.  Returns the number of bytes
+ * copied.  Used for menus, so the checksum isn't verified.
+ */
+int yank_preview(char *buf, int sz, int n)
+{
+	struct yank *y;
+	assert(n >= 0);
+	assert(n < yank_sz());
+	y = &yanks[n];
+	if ((uint64_t)sz > y->sz)
+		sz = y->sz;
+	if (y->t)
+		memcpy(buf, textdata(y->t), sz);
+	else if (readall(yankfd, buf, sz, y->off) < 0)
+		return 0;
+	return sz;
+}
+
+/*
+ * Stores a copy of a string in the yank buffers.  Returns 0 on success
+ * and -1 if the copy can't be made.
+ */
+int yank_store(char *start, char *end)
+{
+	struct text *t;
+	if (!(t = textnew(start, end)))
+		return -1;
+	yank_storetext(t);
+	textunref(t);
+	return 0;
 }
 
 /*
- * Stores a string in the yank buffers.
+ * Stores already copied text in the yank buffers.  The yank ring takes
+ * its own reference, so the caller can keep sharing `t` (e.g. with the
+ * undo list) without another copy.
  */
-void yank_store(char *start, char *end)
+void yank_storetext(struct text *t)
 {
+	/* Pick up the ring as saved last, by this lwe or another, so the
+	 * next save keeps it. */
+	loadyanks();
 	shiftyanks();
-	int sz = end - start;
-	assert(sz >= 0);
-	yank_sizes[0] = sz;
-	yank_buffers[0] = malloc(sz);
-	memcpy(yank_buffers[0], start, sz);
+	stats.yanked += textsz(t);
+	memadd(&stats.yankbytes, textsz(t));
+	yanks[0].t = textref(t);
+	yanks[0].sz = textsz(t);
 }
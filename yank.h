@@ -1,7 +1,13 @@
 /* (C) 2015 Tom Wright. */
 
+#include <stddef.h>
+
+struct text;
+
 int saveyanks(void);
 int loadyanks(void);
 int yank_sz(void);
-void yank_item(char **item, unsigned *len, int n);
-void yank_store(char *start, char *end);
+int yank_item(char **item, size_t *len, int n);
+int yank_preview(char *buf, int sz, int n);
+int yank_store(char *start, char *end);
+void yank_storetext(struct text *t);